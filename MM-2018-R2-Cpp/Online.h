@@ -5,6 +5,17 @@
 #include <algorithm>
 #include <queue>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <type_traits>
 
 using namespace std;
 
@@ -19,6 +30,55 @@ using namespace std;
 #endif
 //#define USE_SLOW_ALGORITHM
 #define USE_POTENTIAL_SCORE
+#define USE_PAIR_MOVES
+#define PAIR_MOVES_FIRST_LANTERNS 4 // Best lantern moves of a state completed to lantern pairs
+//#define USE_PORTFOLIO
+#define USE_ADAPTIVE_BEAM_WIDTH
+#define ADAPTIVE_BEAM_TIME_SHARE 0.9 // Part of the remaining time adaptive width is planned for
+//#define USE_DIVERSE_BEAM             // Moves in one board region can fill at most DIVERSE_BEAM_MAX_SHARE times its even share of the beam
+#define DIVERSE_BEAM_MAX_SHARE 1.0
+#define DIVERSE_BEAM_REGION_SIZE 8   // Side of square board regions moves are grouped by
+//#define USE_SOLVER_PROFILES          // Ranking and time schedule are chosen by board class
+#define SOLVER_PROFILES_TOLERANCE 0.001 // Score loss accepted by -profiles sweep for a profile using less time
+//#define USE_SOLUTION_CACHE
+#define SOLUTION_CACHE_FILE "CrystalLighting.cache"
+#define SOLUTION_CACHE_SLOTS 256
+#define SOLUTION_CACHE_MAX_ITEMS 4096
+#define MAX_BOARD_SIZE 100
+#define CANDIDATE_MIN_SCORE (-256)
+#define CANDIDATE_BUCKETS_COUNT 512
+#define CELL_LAYOUT_PLANAR 0      // Every cell field in its own array
+#define CELL_LAYOUT_INTERLEAVED 1 // Cell fields used by tracers stored together, cells in row order
+#define CELL_LAYOUT_TILED 2       // Cell fields used by tracers stored together, cells in square tiles
+#define CELL_LAYOUT CELL_LAYOUT_PLANAR
+#define CELL_LAYOUT_TILE_SIZE 4
+#ifndef USE_PORTFOLIO
+#define USE_PARALLEL_MOVES            // Calculate moves of many cells of one state on all cores (portfolio already uses them)
+#endif
+#define PARALLEL_MOVES_MIN_CELLS 8192 // Invalidated cells needed to calculate their moves in parallel
+#define PARALLEL_MOVES_CHUNK 256      // Cells calculated by one thread at once
+#define PARALLEL_MOVES_THREADS 0      // Threads including the caller, 0 for all cores
+#define USE_EXACT_SOLVER
+#define EXACT_SOLVER_MAX_CELLS 100    // Boards solved by exact search first
+#define EXACT_SOLVER_MAX_CRYSTALS 24
+#define EXACT_SOLVER_BEAM_SHARE 0.1   // Part of the time beam search gets to find the first bound of exact search
+#define EXACT_SOLVER_TIME_SHARE 0.6   // Part of the time exact search ends by; if it is not done, beam search gets the rest
+#define USE_USEFUL_MOVES              // Lantern colors and obstacles that can never pay off on the board are not tried
+#define USE_FIXED_STRIDE_TRACERS      // Tracers of board widths listed in State::DispatchStride use compile-time row stride
+#define ITEM_ARENA_BLOCK_SIZE 65536   // Placed item nodes allocated at once
+//#define USE_ALLOCATION_TRACKING       // Replaced operator new counts allocations per solver phase and beam level
+#define ALLOCATION_TRACKING_LEVELS 4096
+//#define USE_CHECKPOINT                // Beam search writes its beam between levels and a new run resumes from it
+#define CHECKPOINT_FILE "CrystalLighting.checkpoint"
+#define CHECKPOINT_INTERVAL 1.0       // Seconds between checkpoint writes
+//#define USE_SEARCH_TRACE              // Beam search levels and selected moves are written to the trace file
+#define SEARCH_TRACE_FILE "CrystalLighting.trace"
+//#define USE_PROCESS_SHARDS            // Moves of wide beam levels are calculated by worker processes (not on Windows)
+#define PROCESS_SHARDS_COUNT 0        // Worker processes, 0 for all cores
+#define PROCESS_SHARDS_MIN_STATES 64  // Beam states needed to shard a level
+#define PROCESS_SHARDS_MIN_CELLS 2500 // Boards with fewer cells are solved in one process
+#define PROCESS_SHARDS_MEMORY (16ull << 30)         // Shared memory reserved for state buffers
+#define PROCESS_SHARDS_RESULTS_MEMORY (256ull << 20) // Shared memory reserved for moves of one batch of states
 
 #ifndef WIN32
 
@@ -45,6 +105,14 @@ double getTime()
 typedef char int8;
 typedef short int16;
 
+#if MAX_BOARD_SIZE <= 100
+typedef int8 coord; // Board coordinate
+typedef int16 mpos; // Map position (index of the cell in board arrays)
+#else
+typedef int16 coord;
+typedef int mpos;
+#endif
+
 template<class T> inline T operator~ (T a) { return (T)~(int)a; }
 template<class T> inline T operator| (T a, T b) { return (T)((int)a | (int)b); }
 template<class T> inline T operator& (T a, T b) { return (T)((int)a & (int)b); }
@@ -107,14 +175,14 @@ enum class Light : unsigned short
 
 struct Position
 {
-    int8 x;
-    int8 y;
+    coord x;
+    coord y;
 
     Position()
     {
     }
 
-    Position(int8 x, int8 y)
+    Position(coord x, coord y)
         : x(x)
         , y(y)
     {
@@ -165,6 +233,25 @@ enum class MoveType : int8
     Lantern,
     Obstacle,
     Mirror,
+    LanternPair, // Two lanterns lighting one secondary crystal together
+};
+
+// Items placed by applied moves. Every placed item adds one immutable node pointing to the item placed
+// before it, so all states share their common history and a state copy copies only its leaf.
+struct ItemNode
+{
+    const ItemNode* parent;
+    union
+    {
+        Lantern lantern;
+        Obstacle obstacle;
+        Mirror mirror;
+    };
+    MoveType type;
+
+    ItemNode()
+    {
+    }
 };
 
 struct State;
@@ -172,14 +259,15 @@ struct State;
 struct Move
 {
     State* state;
-    int score;
-    int potentialScore;
+    int16 score;
+    int16 potentialScore;
     int hash;
     union
     {
         Lantern lantern;
         Obstacle obstacle;
         Mirror mirror;
+        Lantern lanterns[2];
     };
     MoveType type;
 
@@ -189,94 +277,613 @@ struct Move
     }
 
     Move(State* state, Lantern lantern, int cost);
+    Move(State* state, Lantern lantern, int score, int potentialScore);
     Move(State* state, Obstacle obstacle, int cost);
     Move(State* state, Mirror mirror, int cost);
+    Move(State* state, Lantern first, Lantern second, int score, int potentialScore);
 
     void ApplyToMe(int costLantern, int costObstacle, int costMirror);
     State Apply(int costLantern, int costObstacle, int costMirror) const;
     bool Same(const Move& other) const;
+
+private:
+    bool Places(const ItemNode& item) const;
 };
 
 
-struct MoveComparisonType
+// Ranking policies: which score is used to order moves and states
+struct ScoreRanking
+{
+    template<class T>
+    static int Rank(const T& value)
+    {
+        return value.score;
+    }
+};
+
+struct PotentialScoreRanking
 {
-    bool operator()(const Move& m1, const Move& m2) const
+    template<class T>
+    static int Rank(const T& value)
     {
+        return value.potentialScore;
+    }
+};
+
 #ifdef USE_POTENTIAL_SCORE
-        return m2.potentialScore < m1.potentialScore;
+typedef PotentialScoreRanking DefaultRanking;
 #else
-        return m2.score < m1.score;
+typedef ScoreRanking DefaultRanking;
 #endif
-    }
-};
 
 struct PrecalculatedMoves
 {
     Move moves[3];
     int8 movesCount;
+    int8 indexedCount;         // Number of moves currently linked into candidate buckets
+    mpos nextCandidate[3];     // Next candidate (mp * 3 + index) in the same bucket
+    mpos previousCandidate[3]; // Previous candidate (mp * 3 + index) in the same bucket
 
     PrecalculatedMoves()
         : movesCount(-1)
+        , indexedCount(-1)
+    {
+    }
+};
+
+// Fields of one cell that tracers read and write together
+struct CellFields
+{
+    BoardField board;
+    Light lightMap;
+    Light crystalsLightMap;
+    mpos crystalsFromLeft;
+    mpos crystalsFromRight;
+    mpos crystalsFromUp;
+    mpos crystalsFromDown;
+};
+
+struct CellLayout
+{
+    // Order in which cells are stored in tiled layout
+    static vector<mpos> cellOrder;
+
+#if CELL_LAYOUT == CELL_LAYOUT_TILED
+    static void Update(coord width, coord height)
+    {
+        mpos index = 0;
+
+        cellOrder.resize(width * height);
+        for (coord ty = 0; ty < height; ty += CELL_LAYOUT_TILE_SIZE)
+            for (coord tx = 0; tx < width; tx += CELL_LAYOUT_TILE_SIZE)
+                for (coord y = ty; y < height && y < ty + CELL_LAYOUT_TILE_SIZE; y++)
+                    for (coord x = tx; x < width && x < tx + CELL_LAYOUT_TILE_SIZE; x++)
+                        cellOrder[y * width + x] = index++;
+    }
+#else
+    static void Update(coord /*width*/, coord /*height*/)
+    {
+    }
+#endif
+};
+
+vector<mpos> CellLayout::cellOrder;
+
+// Array of one cell field indexed by map position, stored as selected by CELL_LAYOUT
+template<class T>
+struct CellArray
+{
+    char* base;
+
+    T& operator[](int mp) const
+    {
+#if CELL_LAYOUT == CELL_LAYOUT_PLANAR
+        return ((T*)base)[mp];
+#elif CELL_LAYOUT == CELL_LAYOUT_INTERLEAVED
+        return *(T*)(base + mp * sizeof(CellFields));
+#else
+        return *(T*)(base + CellLayout::cellOrder[mp] * sizeof(CellFields));
+#endif
+    }
+};
+
+#ifdef USE_ALLOCATION_TRACKING
+
+#include <cstdlib>
+#include <new>
+
+enum class AllocationPhase
+{
+    Setup,
+    ExactSearch,
+    BeamSearch,
+    Output,
+    Count
+};
+
+// Counts allocations of replaced operator new by solver phase and beam level. Counters are fixed arrays
+// of atomics, so counting does not allocate and threads of one board add to the same counters.
+class AllocationTracker
+{
+public:
+    static void Allocated(size_t size)
+    {
+        Counters& counters = GetCounters();
+        int phase = counters.phase.load(memory_order_relaxed);
+
+        counters.phases[phase].Add(size);
+        if (phase == (int)AllocationPhase::BeamSearch)
+            counters.levels[std::min(counters.level.load(memory_order_relaxed), ALLOCATION_TRACKING_LEVELS - 1)].Add(size);
+    }
+
+    // State buffer pool was empty, so a new buffer was allocated
+    static void PoolMiss(size_t size)
+    {
+        GetCounters().poolMisses.Add(size);
+    }
+
+    static void SetPhase(AllocationPhase phase)
+    {
+        GetCounters().phase.store((int)phase, memory_order_relaxed);
+    }
+
+    static void SetLevel(int level)
+    {
+        GetCounters().level.store(level, memory_order_relaxed);
+    }
+
+    static void Reset()
+    {
+        Counters& counters = GetCounters();
+
+        for (auto& counter : counters.phases)
+            counter.Clear();
+        for (auto& counter : counters.levels)
+            counter.Clear();
+        counters.poolMisses.Clear();
+        counters.phase.store((int)AllocationPhase::Setup, memory_order_relaxed);
+        counters.level.store(0, memory_order_relaxed);
+    }
+
+    // Prints counts per phase and per ranges of beam levels, at most 10 ranges
+    static void Report(ostream& out)
+    {
+        static const char* phaseNames[] = { "setup", "exact search", "beam search", "output" };
+        Counters& counters = GetCounters();
+        int levels = 0;
+
+        out << "Allocations:";
+        for (int i = 0; i < (int)AllocationPhase::Count; i++)
+            out << (i > 0 ? "," : "") << " " << phaseNames[i] << " " << counters.phases[i].count << " (" << counters.phases[i].bytes << " bytes)";
+        out << ", state buffer pool misses " << counters.poolMisses.count << " (" << counters.poolMisses.bytes << " bytes)" << endl;
+        for (int level = 0; level < ALLOCATION_TRACKING_LEVELS; level++)
+            if (counters.levels[level].count > 0)
+                levels = level + 1;
+
+        int rangeSize = std::max(1, (levels + 9) / 10);
+
+        for (int first = 0; first < levels; first += rangeSize)
+        {
+            long long count = 0, bytes = 0;
+            int last = std::min(levels, first + rangeSize) - 1;
+
+            for (int level = first; level <= last; level++)
+            {
+                count += counters.levels[level].count;
+                bytes += counters.levels[level].bytes;
+            }
+            out << "  Levels " << first << "-" << last << ": " << count << " allocations, " << bytes << " bytes" << endl;
+        }
+    }
+
+private:
+    struct Counter
+    {
+        atomic<long long> count;
+        atomic<long long> bytes;
+
+        void Add(size_t size)
+        {
+            count.fetch_add(1, memory_order_relaxed);
+            bytes.fetch_add((long long)size, memory_order_relaxed);
+        }
+
+        void Clear()
+        {
+            count.store(0, memory_order_relaxed);
+            bytes.store(0, memory_order_relaxed);
+        }
+    };
+
+    struct Counters
+    {
+        Counter phases[(int)AllocationPhase::Count];
+        Counter levels[ALLOCATION_TRACKING_LEVELS];
+        Counter poolMisses;
+        atomic<int> phase;
+        atomic<int> level;
+    };
+
+    // Zero initialized without a constructor, so it can be used by operator new before static initialization
+    static Counters& GetCounters()
+    {
+        static Counters counters;
+
+        return counters;
+    }
+};
+
+void* operator new(size_t size)
+{
+    AllocationTracker::Allocated(size);
+
+    void* memory = malloc(size > 0 ? size : 1);
+
+    if (memory == nullptr)
+        throw bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+#endif
+
+// Fixed set of worker threads shared by all states. ParallelFor splits range to chunks that are processed
+// by the workers and the calling thread and returns when all chunks are done.
+class ThreadPool
+{
+public:
+    static ThreadPool& Instance()
+    {
+        static ThreadPool pool(PARALLEL_MOVES_THREADS > 0 ? PARALLEL_MOVES_THREADS : std::max(1u, thread::hardware_concurrency()));
+
+        return pool;
+    }
+
+    explicit ThreadPool(unsigned threadsCount)
+        : stopping(false)
+        , generation(0)
+        , activeWorkers(0)
+        , jobCount(0)
+        , jobChunkSize(1)
+        , nextIndex(0)
+    {
+        for (unsigned i = 1; i < threadsCount; i++)
+            workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobStarted.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    size_t ThreadsCount() const
+    {
+        return workers.size() + 1;
+    }
+
+    // Set in forked processes, which have only the thread that forked them and must not wait for workers
+    static bool& Disabled()
+    {
+        static bool disabled = false;
+
+        return disabled;
+    }
+
+    void ParallelFor(int count, int chunkSize, function<void(int, int)> body)
+    {
+        lock_guard<mutex> callLock(callMutex);
+
+        {
+            lock_guard<mutex> lock(jobMutex);
+            job = std::move(body);
+            jobCount = count;
+            jobChunkSize = chunkSize;
+            nextIndex = 0;
+            activeWorkers = workers.size();
+            generation++;
+        }
+        jobStarted.notify_all();
+        RunChunks();
+
+        unique_lock<mutex> lock(jobMutex);
+        jobFinished.wait(lock, [this] { return activeWorkers == 0; });
+    }
+
+private:
+    vector<thread> workers;
+    mutex callMutex;
+    mutex jobMutex;
+    condition_variable jobStarted;
+    condition_variable jobFinished;
+    bool stopping;
+    unsigned generation;
+    size_t activeWorkers;
+    function<void(int, int)> job;
+    int jobCount;
+    int jobChunkSize;
+    atomic<int> nextIndex;
+
+    void RunChunks()
+    {
+        for (int begin = nextIndex.fetch_add(jobChunkSize); begin < jobCount; begin = nextIndex.fetch_add(jobChunkSize))
+            job(begin, std::min(jobCount, begin + jobChunkSize));
+    }
+
+    void WorkerLoop()
+    {
+        unsigned seenGeneration = 0;
+
+        while (true)
+        {
+            {
+                unique_lock<mutex> lock(jobMutex);
+
+                jobStarted.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping)
+                    return;
+                seenGeneration = generation;
+            }
+            RunChunks();
+
+            lock_guard<mutex> lock(jobMutex);
+            if (--activeWorkers == 0)
+                jobFinished.notify_one();
+        }
+    }
+};
+
+// Item nodes are never freed one by one. Every solver thread fills its own block and only taking a new
+// block is locked. Reset frees all nodes at once, when no state is alive.
+class ItemArena
+{
+public:
+    static ItemNode* Allocate(const ItemNode* parent, MoveType type)
+    {
+        static thread_local ThreadBlock block = { nullptr, 0, 0 };
+        Blocks& blocks = GetBlocks();
+
+        if (block.epoch != blocks.epoch || block.used == ITEM_ARENA_BLOCK_SIZE)
+        {
+            lock_guard<mutex> lock(blocks.blocksMutex);
+
+            block.nodes = new ItemNode[ITEM_ARENA_BLOCK_SIZE];
+            block.used = 0;
+            block.epoch = blocks.epoch;
+            blocks.blocks.push_back(block.nodes);
+        }
+
+        ItemNode* node = block.nodes + block.used++;
+
+        node->parent = parent;
+        node->type = type;
+        return node;
+    }
+
+    static void Reset()
+    {
+        Blocks& blocks = GetBlocks();
+        lock_guard<mutex> lock(blocks.blocksMutex);
+
+        for (ItemNode* nodes : blocks.blocks)
+            delete[] nodes;
+        blocks.blocks.clear();
+        blocks.epoch++;
+    }
+
+private:
+    struct ThreadBlock
+    {
+        ItemNode* nodes;
+        int used;
+        unsigned epoch;
+    };
+
+    struct Blocks
+    {
+        mutex blocksMutex;
+        vector<ItemNode*> blocks;
+        unsigned epoch = 1; // Thread blocks from older epochs were freed
+
+        ~Blocks()
+        {
+            for (ItemNode* nodes : blocks)
+                delete[] nodes;
+        }
+    };
+
+    static Blocks& GetBlocks()
     {
+        static Blocks blocks;
+
+        return blocks;
     }
 };
 
 struct State
 {
-    BoardField* board;
-    Light* lightMap;
-    Light* crystalsLightMap;
-    int16* crystalsFromLeft;
-    int16* crystalsFromRight;
-    int16* crystalsFromUp;
-    int16* crystalsFromDown;
+    CellArray<BoardField> board;
+    CellArray<Light> lightMap;
+    CellArray<Light> crystalsLightMap;
+    CellArray<mpos> crystalsFromLeft;
+    CellArray<mpos> crystalsFromRight;
+    CellArray<mpos> crystalsFromUp;
+    CellArray<mpos> crystalsFromDown;
     PrecalculatedMoves* precalculatedMoves;
-    int8 width;
-    int8 height;
+    mpos* candidateBuckets;
+    mpos* dirtyCells;
+    mpos dirtyCellsCount;
+    int16 topCandidateBucket;
+    coord width;
+    coord height;
     int score;
     int potentialScore;
+    int litCrystals; // Crystals lit with their own color
     int hash;
-    vector<Lantern> lanterns;
-    vector<Obstacle> obstacles;
-    vector<Mirror> mirrors;
+    const ItemNode* items; // Last placed item
+    int lanternsCount;
+    int obstaclesCount;
+    int mirrorsCount;
     char* memoryBuffer;
 
-    static int MemoryBufferSize(int8 width, int8 height)
+    static int crystalsCount; // Crystals on the board
+    static vector<BoardField> usefulMoves; // Lantern colors and obstacle that can pay off by cell, empty if all can
+
+    static int MemoryBufferSize(coord width, coord height)
     {
         return MemoryBufferSize(width * height);
     }
-    static int MemoryBufferSize(int16 elements)
+    static int MemoryBufferSize(mpos elements)
     {
-        int size = sizeof(board[0]) * elements
-            + sizeof(lightMap[0]) * elements
-            + sizeof(crystalsLightMap[0]) * elements
-            + sizeof(crystalsFromLeft[0]) * elements
-            + sizeof(crystalsFromRight[0]) * elements
-            + sizeof(crystalsFromUp[0]) * elements
-            + sizeof(crystalsFromDown[0]) * elements
-            + sizeof(precalculatedMoves[0]) * elements;
+        int size = sizeof(CellFields) * elements
+            + sizeof(precalculatedMoves[0]) * elements
+            + sizeof(candidateBuckets[0]) * CANDIDATE_BUCKETS_COUNT
+            + sizeof(dirtyCells[0]) * elements;
         return size;
     }
 
-    static vector<char*>& GetMemoryBufferPool(int16 elements)
+    struct MemoryBufferPools
+    {
+        vector<char*> pools[MAX_BOARD_SIZE * MAX_BOARD_SIZE];
+
+        ~MemoryBufferPools()
+        {
+            for (auto& pool : pools)
+                for (char* memoryBuffer : pool)
+                    if (!IsShared(memoryBuffer))
+                        delete[] memoryBuffer;
+        }
+    };
+
+    // Memory shared with forked processes, new buffers are taken from it while it has room. Its buffers are
+    // never freed, they only go back to the pools.
+    struct SharedMemory
+    {
+        mutex allocationMutex;
+        char* begin = nullptr;
+        char* next = nullptr;
+        char* end = nullptr;
+    };
+
+    static SharedMemory& GetSharedMemory()
+    {
+        static SharedMemory sharedMemory;
+
+        return sharedMemory;
+    }
+
+    // Buffers of states created after this call can be used in place by processes forked by the solver.
+    // Pooled buffers of the calling thread are freed, so they are not reused instead of shared ones.
+    static void SetSharedMemory(char* memory, size_t size)
+    {
+        SharedMemory& sharedMemory = GetSharedMemory();
+
+        sharedMemory.begin = memory;
+        sharedMemory.next = memory;
+        sharedMemory.end = memory + size;
+        ReleaseMemoryBuffers();
+    }
+
+    // Frees pooled buffers of the calling thread except those in shared memory. Pools only grow, so this is
+    // done when states of the previous board are gone.
+    static void ReleaseMemoryBuffers()
+    {
+        for (mpos elements = 1; elements <= MAX_BOARD_SIZE * MAX_BOARD_SIZE; elements++)
+        {
+            vector<char*>& memoryBufferPool = GetMemoryBufferPool(elements);
+            size_t kept = 0;
+
+            for (char* memoryBuffer : memoryBufferPool)
+                if (IsShared(memoryBuffer))
+                    memoryBufferPool[kept++] = memoryBuffer;
+                else
+                    delete[] memoryBuffer;
+            memoryBufferPool.resize(kept);
+        }
+    }
+
+    static bool IsShared(const char* memoryBuffer)
+    {
+        SharedMemory& sharedMemory = GetSharedMemory();
+
+        return memoryBuffer >= sharedMemory.begin && memoryBuffer < sharedMemory.end;
+    }
+
+    static char* AllocateShared(mpos elements)
+    {
+        SharedMemory& sharedMemory = GetSharedMemory();
+        size_t size = (MemoryBufferSize(elements) + 63) / 64 * 64;
+        lock_guard<mutex> lock(sharedMemory.allocationMutex);
+
+        if (sharedMemory.next == nullptr || (size_t)(sharedMemory.end - sharedMemory.next) < size)
+            return nullptr;
+
+        char* memoryBuffer = sharedMemory.next;
+
+        sharedMemory.next += size;
+        return memoryBuffer;
+    }
+
+    static vector<char*>& GetMemoryBufferPool(mpos elements)
     {
-        static vector<char*> memoryBufferPools[100 * 100];
+        // Every solver thread keeps its own pool, so no locking is needed
+        static thread_local MemoryBufferPools memoryBufferPools;
 
-        return memoryBufferPools[elements - 1];
+        return memoryBufferPools.pools[elements - 1];
     }
 
-    static void ReturnMemoryBuffer(char* memoryBuffer, int16 elements)
+    static void ReturnMemoryBuffer(char* memoryBuffer, mpos elements)
     {
-        GetMemoryBufferPool(elements).push_back(memoryBuffer);
+        // Once there is shared memory, buffers allocated before are not reused
+        if (GetSharedMemory().begin != nullptr && !IsShared(memoryBuffer))
+            delete[] memoryBuffer;
+        else
+            GetMemoryBufferPool(elements).push_back(memoryBuffer);
     }
 
-    static char* GetMemoryBuffer(int16 elements)
+    static char* GetMemoryBuffer(mpos elements)
     {
         vector<char*>& memoryBufferPool = GetMemoryBufferPool(elements);
         char* memoryBuffer;
 
         if (memoryBufferPool.empty())
-            memoryBuffer = new char[MemoryBufferSize(elements)];
+        {
+#ifdef USE_ALLOCATION_TRACKING
+            AllocationTracker::PoolMiss(MemoryBufferSize(elements));
+#endif
+            memoryBuffer = AllocateShared(elements);
+            if (memoryBuffer == nullptr)
+                memoryBuffer = new char[MemoryBufferSize(elements)];
+        }
         else
         {
             memoryBuffer = memoryBufferPool.back();
@@ -286,29 +893,42 @@ struct State
     }
 
     State()
-        : memoryBuffer(nullptr)
+        : width(0)
+        , height(0)
+        , items(nullptr)
+        , memoryBuffer(nullptr)
     {
     }
 
-    State(int8 width, int8 height)
+    State(coord width, coord height)
         : width(width)
         , height(height)
         , score(0)
         , potentialScore(0)
+        , litCrystals(0)
         , hash(0)
+        , items(nullptr)
+        , lanternsCount(0)
+        , obstaclesCount(0)
+        , mirrorsCount(0)
     {
+        CellLayout::Update(width, height);
         CreateBuffers(true);
     }
 
     State(const State& state)
-        : width(state.width)
+        : dirtyCellsCount(state.dirtyCellsCount)
+        , topCandidateBucket(state.topCandidateBucket)
+        , width(state.width)
         , height(state.height)
         , score(state.score)
         , potentialScore(state.potentialScore)
+        , litCrystals(state.litCrystals)
         , hash(state.hash)
-        , lanterns(state.lanterns)
-        , obstacles(state.obstacles)
-        , mirrors(state.mirrors)
+        , items(state.items)
+        , lanternsCount(state.lanternsCount)
+        , obstaclesCount(state.obstaclesCount)
+        , mirrorsCount(state.mirrorsCount)
     {
         CreateBuffers(false);
         memcpy(memoryBuffer, state.memoryBuffer, MemoryBufferSize(width, height));
@@ -323,62 +943,105 @@ struct State
     State& operator=(const State& state)
     {
         if (width != state.width || height != state.height)
+        {
+            if (memoryBuffer != nullptr)
+                ReturnMemoryBuffer(memoryBuffer, width * height);
+            width = state.width;
+            height = state.height;
             CreateBuffers(false);
-        width = state.width;
-        height = state.height;
+        }
+        dirtyCellsCount = state.dirtyCellsCount;
+        topCandidateBucket = state.topCandidateBucket;
         score = state.score;
         potentialScore = state.potentialScore;
+        litCrystals = state.litCrystals;
         hash = state.hash;
-        lanterns = state.lanterns;
-        obstacles = state.obstacles;
-        mirrors = state.mirrors;
+        items = state.items;
+        lanternsCount = state.lanternsCount;
+        obstaclesCount = state.obstaclesCount;
+        mirrorsCount = state.mirrorsCount;
         memcpy(memoryBuffer, state.memoryBuffer, MemoryBufferSize(width, height));
         return *this;
     }
 
     void CreateBuffers(bool initialize)
     {
-        int16 elements = width * height;
+        mpos elements = width * height;
+
+        AttachBuffer(GetMemoryBuffer(elements));
+        if (initialize)
+        {
+            for (mpos mp = 0; mp < elements; mp++)
+            {
+                board[mp] = BoardField::Empty;
+                lightMap[mp] = Light::Empty;
+                crystalsLightMap[mp] = Light::Empty;
+                crystalsFromLeft[mp] = -1;
+                crystalsFromRight[mp] = -1;
+                crystalsFromUp[mp] = -1;
+                crystalsFromDown[mp] = -1;
+            }
+            memset(precalculatedMoves, -1, sizeof(precalculatedMoves[0]) * elements);
+            memset(candidateBuckets, -1, sizeof(candidateBuckets[0]) * CANDIDATE_BUCKETS_COUNT);
+
+            // All cells need their moves calculated
+            for (mpos mp = 0; mp < elements; mp++)
+                dirtyCells[mp] = mp;
+            dirtyCellsCount = elements;
+            topCandidateBucket = -1;
+        }
+    }
+
+    // Points cell fields to memory buffer. Buffer of another process's state is attached without taking it
+    // from the pool, so memoryBuffer has to be cleared before this state is destroyed.
+    void AttachBuffer(char* buffer)
+    {
+        mpos elements = width * height;
         int offset = 0;
 
         boardSize = elements;
-        memoryBuffer = GetMemoryBuffer(elements);
+        memoryBuffer = buffer;
 
-        board = (BoardField*)(memoryBuffer + offset);
+#if CELL_LAYOUT == CELL_LAYOUT_PLANAR
+        board.base = memoryBuffer + offset;
         offset += sizeof(board[0]) * elements;
 
-        lightMap = (Light*)(memoryBuffer + offset);
+        lightMap.base = memoryBuffer + offset;
         offset += sizeof(lightMap[0]) * elements;
 
-        crystalsLightMap = (Light*)(memoryBuffer + offset);
+        crystalsLightMap.base = memoryBuffer + offset;
         offset += sizeof(crystalsLightMap[0]) * elements;
 
-        crystalsFromLeft = (int16*)(memoryBuffer + offset);
+        crystalsFromLeft.base = memoryBuffer + offset;
         offset += sizeof(crystalsFromLeft[0]) * elements;
 
-        crystalsFromRight = (int16*)(memoryBuffer + offset);
+        crystalsFromRight.base = memoryBuffer + offset;
         offset += sizeof(crystalsFromRight[0]) * elements;
 
-        crystalsFromUp = (int16*)(memoryBuffer + offset);
+        crystalsFromUp.base = memoryBuffer + offset;
         offset += sizeof(crystalsFromUp[0]) * elements;
 
-        crystalsFromDown = (int16*)(memoryBuffer + offset);
+        crystalsFromDown.base = memoryBuffer + offset;
         offset += sizeof(crystalsFromDown[0]) * elements;
-
+#else
+        board.base = memoryBuffer + offset + offsetof(CellFields, board);
+        lightMap.base = memoryBuffer + offset + offsetof(CellFields, lightMap);
+        crystalsLightMap.base = memoryBuffer + offset + offsetof(CellFields, crystalsLightMap);
+        crystalsFromLeft.base = memoryBuffer + offset + offsetof(CellFields, crystalsFromLeft);
+        crystalsFromRight.base = memoryBuffer + offset + offsetof(CellFields, crystalsFromRight);
+        crystalsFromUp.base = memoryBuffer + offset + offsetof(CellFields, crystalsFromUp);
+        crystalsFromDown.base = memoryBuffer + offset + offsetof(CellFields, crystalsFromDown);
+        offset += sizeof(CellFields) * elements;
+#endif
+
         precalculatedMoves = (PrecalculatedMoves*)(memoryBuffer + offset);
         offset += sizeof(precalculatedMoves[0]) * elements;
 
-        if (initialize)
-        {
-            memset(board, (int)BoardField::Empty, sizeof(board[0]) * elements);
-            memset(lightMap, (int)Light::Empty, sizeof(lightMap[0]) * elements);
-            memset(crystalsLightMap, (int)Light::Empty, sizeof(crystalsLightMap[0]) * elements);
-            memset(crystalsFromLeft, -1, sizeof(crystalsFromLeft[0]) * elements);
-            memset(crystalsFromRight, -1, sizeof(crystalsFromRight[0]) * elements);
-            memset(crystalsFromUp, -1, sizeof(crystalsFromUp[0]) * elements);
-            memset(crystalsFromDown, -1, sizeof(crystalsFromDown[0]) * elements);
-            memset(precalculatedMoves, -1, sizeof(precalculatedMoves[0]) * elements);
-        }
+        candidateBuckets = (mpos*)(memoryBuffer + offset);
+        offset += sizeof(candidateBuckets[0]) * CANDIDATE_BUCKETS_COUNT;
+
+        dirtyCells = (mpos*)(memoryBuffer + offset);
+        offset += sizeof(dirtyCells[0]) * elements;
     }
 
     State(State&& state)
@@ -389,38 +1052,103 @@ struct State
         , crystalsFromRight(std::move(state.crystalsFromRight))
         , crystalsFromUp(std::move(state.crystalsFromUp))
         , crystalsFromDown(std::move(state.crystalsFromDown))
-        , lanterns(std::move(state.lanterns))
-        , obstacles(std::move(state.obstacles))
-        , mirrors(std::move(state.mirrors))
         , precalculatedMoves(std::move(state.precalculatedMoves))
+        , candidateBuckets(std::move(state.candidateBuckets))
+        , dirtyCells(std::move(state.dirtyCells))
+        , dirtyCellsCount(state.dirtyCellsCount)
+        , topCandidateBucket(state.topCandidateBucket)
         , width(state.width)
         , height(state.height)
         , score(state.score)
         , potentialScore(state.potentialScore)
+        , litCrystals(state.litCrystals)
         , hash(state.hash)
+        , items(state.items)
+        , lanternsCount(state.lanternsCount)
+        , obstaclesCount(state.obstaclesCount)
+        , mirrorsCount(state.mirrorsCount)
         , memoryBuffer(state.memoryBuffer)
     {
         state.memoryBuffer = nullptr;
     }
 
+    // Placed items in order they were placed
+    void GetItems(vector<Lantern>& lanterns, vector<Obstacle>& obstacles, vector<Mirror>& mirrors) const
+    {
+        lanterns.clear();
+        obstacles.clear();
+        mirrors.clear();
+        for (const ItemNode* node = items; node != nullptr; node = node->parent)
+            switch (node->type)
+            {
+                case MoveType::Lantern:
+                    lanterns.push_back(node->lantern);
+                    break;
+                case MoveType::Obstacle:
+                    obstacles.push_back(node->obstacle);
+                    break;
+                case MoveType::Mirror:
+                    mirrors.push_back(node->mirror);
+                    break;
+                case MoveType::LanternPair: // Pair is stored as two lantern items
+                    break;
+            }
+        reverse(lanterns.begin(), lanterns.end());
+        reverse(obstacles.begin(), obstacles.end());
+        reverse(mirrors.begin(), mirrors.end());
+    }
+
+    // Placed items in the output format of placeItems
+    vector<string> GetResult() const
+    {
+        vector<string> result;
+        vector<Lantern> lanterns;
+        vector<Obstacle> obstacles;
+        vector<Mirror> mirrors;
+
+        GetItems(lanterns, obstacles, mirrors);
+        for (auto& obstacle : obstacles)
+        {
+            stringstream ss;
+            ss << (int)obstacle.position.y << " " << (int)obstacle.position.x << " X";
+            result.push_back(ss.str());
+        }
+        for (auto& mirror : mirrors)
+        {
+            stringstream ss;
+            ss << (int)mirror.position.y << " " << (int)mirror.position.x << " " << (mirror.slash ? '/' : '\\');
+            result.push_back(ss.str());
+        }
+        for (auto& lantern : lanterns)
+        {
+            stringstream ss;
+            ss << (int)lantern.position.y << " " << (int)lantern.position.x << " " << (int)lantern.color;
+            result.push_back(ss.str());
+        }
+        return result;
+    }
+
     void UpdateFromBoard()
     {
         // Initialize crystals light map
-        int16 mp = 0;
-        for (int8 y = 0; y < height; y++)
-            for (int8 x = 0; x < width; x++, mp++)
+        mpos mp = 0;
+        crystalsCount = 0;
+        for (coord y = 0; y < height; y++)
+            for (coord x = 0; x < width; x++, mp++)
                 if ((board[mp] & BoardField::Crystal) != BoardField::Empty)
                 {
                     Color color = (Color)(board[mp] & BoardField::ColorMask);
 
-                    AddColorDown(x, y + 1, mp + width, width, color, crystalsLightMap, board);
-                    AddColorUp(x, y - 1, mp - width, width, color, crystalsLightMap, board);
-                    AddColorLeft(x - 1, y, mp - 1, width, color, crystalsLightMap, board);
-                    AddColorRight(x + 1, y, mp + 1, width, color, crystalsLightMap, board);
-                    UpdateMapDown(x, y + 1, mp + width, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-                    UpdateMapUp(x, y - 1, mp - width, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-                    UpdateMapLeft(x - 1, y, mp - 1, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-                    UpdateMapRight(x + 1, y, mp + 1, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                    crystalsCount++;
+
+                    AddColorDown<0>(x, y + 1, mp + width, width, color, crystalsLightMap, board);
+                    AddColorUp<0>(x, y - 1, mp - width, width, color, crystalsLightMap, board);
+                    AddColorLeft<0>(x - 1, y, mp - 1, width, color, crystalsLightMap, board);
+                    AddColorRight<0>(x + 1, y, mp + 1, width, color, crystalsLightMap, board);
+                    UpdateMapDown<0>(x, y + 1, mp + width, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                    UpdateMapUp<0>(x, y - 1, mp - width, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                    UpdateMapLeft<0>(x - 1, y, mp - 1, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                    UpdateMapRight<0>(x + 1, y, mp + 1, width, mp, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
                 }
     }
 
@@ -429,75 +1157,401 @@ struct State
         return board[y * width + x];
     }
 
-    static bool MoveComparison(const Move& m1, const Move& m2)
+    // Reference implementation: recalculates all maps and scores from placed items instead of updating them incrementally
+    State Rebuild(int costLantern, int costMirror, int costObstacle) const
     {
-#ifdef USE_POTENTIAL_SCORE
-        return m2.potentialScore < m1.potentialScore;
-#else
-        return m2.score < m1.score;
-#endif
-    }
+        State result(width, height);
+        mpos mpMax = width * height;
 
-    void GetTopMoves(vector<Move>& moves, size_t maxMoves, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
-    {
-        UpdateMoves(costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+        for (mpos mp = 0; mp < mpMax; mp++)
+            result.board[mp] = board[mp];
+        result.items = items;
+        result.lanternsCount = lanternsCount;
+        result.obstaclesCount = obstaclesCount;
+        result.mirrorsCount = mirrorsCount;
+        result.UpdateFromBoard();
 
-        // Take first maxMoves
-        PrecalculatedMoves* preMoves = precalculatedMoves;
-        int16 mp = 0, mpMax = width * height;
-        bool obstaclesOk = (int)obstacles.size() < maxObstacles;
-        bool mirrorsOk = (int)mirrors.size() < maxMirrors;
+        vector<Lantern> lanterns;
+        vector<Obstacle> obstacles;
+        vector<Mirror> mirrors;
 
-        moves.clear();
-        moves.reserve(maxMoves * 2);
-        for (; mp < mpMax && moves.size() < maxMoves; mp++, preMoves++)
-            for (int8 i = 0; i < preMoves->movesCount; i++)
+        GetItems(lanterns, obstacles, mirrors);
+
+        // Trace light from all lanterns
+        for (auto& lantern : lanterns)
+        {
+            mpos mp = lantern.position.y * width + lantern.position.x;
+
+            AddColorLeft<0>(lantern.position.x - 1, lantern.position.y, mp - 1, width, lantern.color, result.lightMap, result.board);
+            AddColorRight<0>(lantern.position.x + 1, lantern.position.y, mp + 1, width, lantern.color, result.lightMap, result.board);
+            AddColorUp<0>(lantern.position.x, lantern.position.y - 1, mp - width, width, lantern.color, result.lightMap, result.board);
+            AddColorDown<0>(lantern.position.x, lantern.position.y + 1, mp + width, width, lantern.color, result.lightMap, result.board);
+            result.hash ^= lantern.GetHash();
+        }
+        for (auto& obstacle : obstacles)
+            result.hash ^= obstacle.GetHash();
+        for (auto& mirror : mirrors)
+            result.hash ^= mirror.GetHash();
+
+        // Score lit crystals
+        result.score = -(lanternsCount * costLantern + mirrorsCount * costMirror + obstaclesCount * costObstacle);
+        result.potentialScore = result.score;
+        for (mpos mp = 0; mp < mpMax; mp++)
+            if ((result.board[mp] & BoardField::Crystal) != BoardField::Empty)
             {
-                Move& move = preMoves->moves[i];
+                Color crystalColor = (Color)(result.board[mp] & BoardField::ColorMask);
+                Color lightColor = (Color)(result.lightMap[mp] & Light::ColorMask);
 
-                if (move.type == MoveType::Obstacle && !obstaclesOk)
-                    continue;
-                if (move.type == MoveType::Mirror && !mirrorsOk)
-                    continue;
+                result.score += GetCrystalScore(crystalColor, lightColor);
+                result.potentialScore += GetCrystalPotentialScore(crystalColor, lightColor);
+                if (lightColor == crystalColor)
+                    result.litCrystals++;
+            }
+        return result;
+    }
 
-                if (!moves.empty())
+    // Compares incrementally updated fields with reference state. Returns description of the first difference or empty string.
+    string Compare(const State& reference) const
+    {
+        stringstream ss;
+        mpos mpMax = width * height;
+
+        if (score != reference.score)
+            ss << "score " << score << " != " << reference.score;
+        else if (potentialScore != reference.potentialScore)
+            ss << "potentialScore " << potentialScore << " != " << reference.potentialScore;
+        else if (litCrystals != reference.litCrystals)
+            ss << "litCrystals " << litCrystals << " != " << reference.litCrystals;
+        else if (hash != reference.hash)
+            ss << "hash " << hash << " != " << reference.hash;
+        else
+            for (mpos mp = 0; mp < mpMax; mp++)
+            {
+                const char* field = nullptr;
+                int value = 0, referenceValue = 0;
+
+                if (board[mp] != reference.board[mp])
+                    field = "board", value = (int)board[mp], referenceValue = (int)reference.board[mp];
+                else if (lightMap[mp] != reference.lightMap[mp])
+                    field = "lightMap", value = (int)lightMap[mp], referenceValue = (int)reference.lightMap[mp];
+                else if (crystalsLightMap[mp] != reference.crystalsLightMap[mp])
+                    field = "crystalsLightMap", value = (int)crystalsLightMap[mp], referenceValue = (int)reference.crystalsLightMap[mp];
+                else if (crystalsFromLeft[mp] != reference.crystalsFromLeft[mp])
+                    field = "crystalsFromLeft", value = crystalsFromLeft[mp], referenceValue = reference.crystalsFromLeft[mp];
+                else if (crystalsFromRight[mp] != reference.crystalsFromRight[mp])
+                    field = "crystalsFromRight", value = crystalsFromRight[mp], referenceValue = reference.crystalsFromRight[mp];
+                else if (crystalsFromUp[mp] != reference.crystalsFromUp[mp])
+                    field = "crystalsFromUp", value = crystalsFromUp[mp], referenceValue = reference.crystalsFromUp[mp];
+                else if (crystalsFromDown[mp] != reference.crystalsFromDown[mp])
+                    field = "crystalsFromDown", value = crystalsFromDown[mp], referenceValue = reference.crystalsFromDown[mp];
+                if (field != nullptr)
                 {
-                    auto it = lower_bound(moves.begin(), moves.end(), move, MoveComparison);
-
-                    moves.insert(it, move);
+                    ss << field << "[" << mp / width << "][" << mp % width << "] " << value << " != " << referenceValue;
+                    break;
                 }
-                else
-                    moves.push_back(move);
             }
-        if (moves.size() >= maxMoves)
+        return ss.str();
+    }
+
+    // Binary snapshot: header, placed items in placement order and the raw buffer block. The block starts at
+    // 8 byte aligned offset, so a snapshot mapped from a file is loaded with a single copy. Raw block is valid
+    // only for the same cell layout and field types, which the header records.
+    struct SnapshotHeader
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t cellLayout;
+        uint8_t mposSize;
+        int32_t width;
+        int32_t height;
+        int32_t score;
+        int32_t potentialScore;
+        int32_t litCrystals;
+        int32_t hash;
+        int32_t crystalsCount;
+        int32_t dirtyCellsCount;
+        int32_t topCandidateBucket;
+        int32_t itemsCount;
+        int32_t bufferSize;
+    };
+
+    struct SnapshotItem
+    {
+        MoveType type;
+        int8 value; // Lantern color or mirror slash
+        int16 x;
+        int16 y;
+    };
+
+    static const uint32_t SnapshotMagic = 0x53534C43; // "CLSS"
+    static const uint16_t SnapshotVersion = 1;
+
+    void Save(ostream& out) const
+    {
+        static const char padding[8] = {};
+        vector<SnapshotItem> snapshotItems = GetSnapshotItems();
+        SnapshotHeader header;
+
+        header.magic = SnapshotMagic;
+        header.version = SnapshotVersion;
+        header.cellLayout = CELL_LAYOUT;
+        header.mposSize = sizeof(mpos);
+        header.width = width;
+        header.height = height;
+        header.score = score;
+        header.potentialScore = potentialScore;
+        header.litCrystals = litCrystals;
+        header.hash = hash;
+        header.crystalsCount = crystalsCount;
+        header.dirtyCellsCount = dirtyCellsCount;
+        header.topCandidateBucket = topCandidateBucket;
+        header.itemsCount = (int32_t)snapshotItems.size();
+        header.bufferSize = MemoryBufferSize(width, height);
+
+        size_t itemsEnd = sizeof(header) + sizeof(SnapshotItem) * snapshotItems.size();
+
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)snapshotItems.data(), sizeof(SnapshotItem) * snapshotItems.size());
+        out.write(padding, (8 - itemsEnd % 8) % 8);
+        out.write(memoryBuffer, header.bufferSize);
+    }
+
+    // Loads snapshot written by Save from memory. Returns false if the snapshot is damaged or was written by
+    // a different build.
+    bool Load(const char* data, size_t size)
+    {
+        SnapshotHeader header;
+
+        if (size < sizeof(header))
+            return false;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != SnapshotMagic || header.version != SnapshotVersion || header.cellLayout != CELL_LAYOUT || header.mposSize != sizeof(mpos))
+            return false;
+        if (header.width <= 0 || header.width > MAX_BOARD_SIZE || header.height <= 0 || header.height > MAX_BOARD_SIZE || header.itemsCount < 0)
+            return false;
+
+        size_t itemsEnd = sizeof(header) + sizeof(SnapshotItem) * header.itemsCount;
+        size_t bufferOffset = (itemsEnd + 7) / 8 * 8;
+
+        if (header.bufferSize != MemoryBufferSize((coord)header.width, (coord)header.height) || size < bufferOffset + header.bufferSize)
+            return false;
+
+        if (memoryBuffer != nullptr)
+            ReturnMemoryBuffer(memoryBuffer, width * height);
+        width = (coord)header.width;
+        height = (coord)header.height;
+        CellLayout::Update(width, height);
+        CreateBuffers(false);
+        memcpy(memoryBuffer, data + bufferOffset, header.bufferSize);
+        score = header.score;
+        potentialScore = header.potentialScore;
+        litCrystals = header.litCrystals;
+        hash = header.hash;
+        crystalsCount = header.crystalsCount;
+        dirtyCellsCount = (mpos)header.dirtyCellsCount;
+        topCandidateBucket = (int16)header.topCandidateBucket;
+        items = nullptr;
+        lanternsCount = 0;
+        obstaclesCount = 0;
+        mirrorsCount = 0;
+        for (int32_t i = 0; i < header.itemsCount; i++)
         {
-            moves.resize(maxMoves);
+            SnapshotItem item;
 
-            // Keep only maxMoves in moves array
-            Move& lastMove = moves[maxMoves - 1];
-            for (; mp < mpMax; mp++, preMoves++)
-                for (int8 i = 0; i < preMoves->movesCount; i++)
-                {
-                    Move& move = preMoves->moves[i];
+            memcpy(&item, data + sizeof(header) + sizeof(SnapshotItem) * i, sizeof(item));
+            AddItem(item);
+        }
+        return true;
+    }
 
-                    if (move.type == MoveType::Obstacle && !obstaclesOk)
-                        continue;
-                    if (move.type == MoveType::Mirror && !mirrorsOk)
-                        continue;
+    bool Load(istream& in)
+    {
+        vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
 
-#ifdef USE_POTENTIAL_SCORE
-                    if (lastMove.potentialScore >= move.potentialScore)
-#else
-                    if (lastMove.score >= move.score)
-#endif
-                        continue;
+        return Load(data.data(), data.size());
+    }
 
-                    auto it = lower_bound(moves.begin(), moves.end(), move, MoveComparison);
+    // Compact form of the state: only placed items, which are put again on the input state by ReplayItems
+    void SaveItems(ostream& out) const
+    {
+        vector<SnapshotItem> snapshotItems = GetSnapshotItems();
+        int32_t itemsCount = (int32_t)snapshotItems.size();
 
-                    moves.insert(it, move);
-                    moves.resize(maxMoves);
-                }
+        out.write((const char*)&itemsCount, sizeof(itemsCount));
+        out.write((const char*)snapshotItems.data(), sizeof(SnapshotItem) * snapshotItems.size());
+    }
+
+    bool ReplayItems(istream& in, int costLantern, int costMirror, int costObstacle)
+    {
+        int32_t itemsCount;
+
+        if (!in.read((char*)&itemsCount, sizeof(itemsCount)) || itemsCount < 0)
+            return false;
+        for (int32_t i = 0; i < itemsCount; i++)
+        {
+            SnapshotItem item;
+
+            if (!in.read((char*)&item, sizeof(item)) || item.x < 0 || item.x >= width || item.y < 0 || item.y >= height)
+                return false;
+            if ((board[item.y * width + item.x] & BoardField::ObjectMask) != BoardField::Empty)
+                return false;
+            switch (item.type)
+            {
+                case MoveType::Lantern:
+                    PutLantern(GetSnapshotLantern(item), costLantern);
+                    break;
+                case MoveType::Obstacle:
+                    PutObstacle(GetSnapshotObstacle(item), costObstacle);
+                    break;
+                case MoveType::Mirror:
+                    PutMirror(GetSnapshotMirror(item), costMirror);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    vector<SnapshotItem> GetSnapshotItems() const
+    {
+        vector<SnapshotItem> snapshotItems;
+
+        for (const ItemNode* node = items; node != nullptr; node = node->parent)
+        {
+            SnapshotItem item;
+            Position position = node->type == MoveType::Lantern ? node->lantern.position : node->type == MoveType::Obstacle ? node->obstacle.position : node->mirror.position;
+
+            item.type = node->type;
+            item.value = node->type == MoveType::Lantern ? (int8)node->lantern.color : node->type == MoveType::Mirror ? (int8)node->mirror.slash : 0;
+            item.x = position.x;
+            item.y = position.y;
+            snapshotItems.push_back(item);
+        }
+        reverse(snapshotItems.begin(), snapshotItems.end());
+        return snapshotItems;
+    }
+
+    static Lantern GetSnapshotLantern(const SnapshotItem& item)
+    {
+        Lantern lantern;
+
+        lantern.position = Position((coord)item.x, (coord)item.y);
+        lantern.color = (Color)item.value;
+        return lantern;
+    }
+
+    static Obstacle GetSnapshotObstacle(const SnapshotItem& item)
+    {
+        Obstacle obstacle;
+
+        obstacle.position = Position((coord)item.x, (coord)item.y);
+        return obstacle;
+    }
+
+    static Mirror GetSnapshotMirror(const SnapshotItem& item)
+    {
+        Mirror mirror;
+
+        mirror.position = Position((coord)item.x, (coord)item.y);
+        mirror.slash = item.value != 0;
+        return mirror;
+    }
+
+    // Adds item to the placed items without putting it on the board, which the loaded buffer already has
+    void AddItem(const SnapshotItem& item)
+    {
+        ItemNode* node = ItemArena::Allocate(items, item.type);
+
+        switch (item.type)
+        {
+            case MoveType::Lantern:
+                node->lantern = GetSnapshotLantern(item);
+                lanternsCount++;
+                break;
+            case MoveType::Obstacle:
+                node->obstacle = GetSnapshotObstacle(item);
+                obstaclesCount++;
+                break;
+            default:
+                node->mirror = GetSnapshotMirror(item);
+                mirrorsCount++;
+                break;
         }
+        items = node;
+    }
+
+    // Checks that every valid precalculated move has the same score as freshly calculated one
+    string ComparePrecalculatedMoves(int costLantern, int costMirror, int costObstacle)
+    {
+        stringstream ss;
+        mpos mpMax = width * height;
+
+        for (mpos mp = 0; mp < mpMax; mp++)
+            for (int i = 0; i < precalculatedMoves[mp].movesCount; i++)
+            {
+                const Move& move = precalculatedMoves[mp].moves[i];
+                Move fresh;
+
+                switch (move.type)
+                {
+                case MoveType::Lantern:
+                    fresh = Move(this, move.lantern, costLantern);
+                    break;
+                case MoveType::Obstacle:
+                    fresh = Move(this, move.obstacle, costObstacle);
+                    break;
+                case MoveType::Mirror:
+                    fresh = Move(this, move.mirror, costMirror);
+                    break;
+                case MoveType::LanternPair: // Pairs are never precalculated
+                    fresh = move;
+                    break;
+                }
+                if (fresh.score != move.score || fresh.potentialScore != move.potentialScore)
+                {
+                    ss << "precalculatedMoves[" << mp / width << "][" << mp % width << "][" << (int)i << "] score " << move.score << "/" << move.potentialScore << " != " << fresh.score << "/" << fresh.potentialScore;
+                    break;
+                }
+            }
+        return ss.str();
+    }
+
+    template<class Ranking>
+    static int16 GetCandidateBucket(const Move& move)
+    {
+        int bucket = Ranking::Rank(move) - CANDIDATE_MIN_SCORE;
+
+        return (int16)std::max(0, std::min(CANDIDATE_BUCKETS_COUNT - 1, bucket));
+    }
+
+    template<class Ranking>
+    void GetTopMoves(vector<Move>& moves, size_t maxMoves, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        UpdateMoves<Ranking>(costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+        // Take first maxMoves by walking candidate buckets from the best score down
+        bool obstaclesOk = obstaclesCount < maxObstacles;
+        bool mirrorsOk = mirrorsCount < maxMirrors;
+
+        moves.clear();
+        moves.reserve(maxMoves);
+        while (topCandidateBucket >= 0 && candidateBuckets[topCandidateBucket] < 0)
+            topCandidateBucket--;
+        for (int16 bucket = topCandidateBucket; bucket >= 0 && moves.size() < maxMoves; bucket--)
+            for (mpos candidate = candidateBuckets[bucket]; candidate >= 0 && moves.size() < maxMoves;)
+            {
+                PrecalculatedMoves& preMoves = precalculatedMoves[candidate / 3];
+                int i = candidate % 3;
+                Move& move = preMoves.moves[i];
+
+                candidate = preMoves.nextCandidate[i];
+                if (move.type == MoveType::Obstacle && !obstaclesOk)
+                    continue;
+                if (move.type == MoveType::Mirror && !mirrorsOk)
+                    continue;
+                moves.push_back(move);
+            }
 
         // Update outdated fields
         for (Move& move : moves)
@@ -514,211 +1568,606 @@ struct State
             case MoveType::Mirror:
                 move.hash = hash ^ move.mirror.GetHash();
                 break;
+            case MoveType::LanternPair:
+                move.hash = hash ^ move.lanterns[0].GetHash() ^ move.lanterns[1].GetHash();
+                break;
             }
         }
+#ifdef USE_PAIR_MOVES
+        AddPairMoves<Ranking>(moves, costLantern);
+#endif
     }
 
-    void UpdateMoves(int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    // Lantern lighting secondary crystal with one of its colors is completed to a pair with the best lantern
+    // adding the other color, so the beam does not spend a level on half lit crystal. Second lanterns are
+    // searched on rays of the crystal.
+    template<class Ranking>
+    void AddPairMoves(vector<Move>& moves, int costLantern)
     {
-        int16 mp = 0;
-        for (int8 y = 0; y < height; y++)
-            for (int8 x = 0; x < width; x++, mp++)
+        static thread_local vector<unsigned> litStamps;
+        static thread_local unsigned stamp = 0;
+        size_t singleMoves = moves.size();
+        int firstLanterns = 0;
+
+        if (litStamps.size() < (size_t)(width * height))
+            litStamps.assign(width * height, 0);
+        for (size_t i = 0; i < singleMoves && firstLanterns < PAIR_MOVES_FIRST_LANTERNS; i++)
+        {
+            if (moves[i].type != MoveType::Lantern)
+                continue;
+            firstLanterns++;
+
+            Lantern first = moves[i].lantern;
+            mpos firstMp = first.position.y * width + first.position.x;
+            mpos firstCrystals[4];
+            Move best;
+
+            GetLanternCrystals(firstMp, firstCrystals);
+            stamp++;
+            for (mpos crystal : firstCrystals)
             {
-                PrecalculatedMoves& preMoves = precalculatedMoves[mp];
+                if (crystal < 0)
+                    continue;
 
-                if (preMoves.movesCount >= 0)
+                Color crystalColor = (Color)(board[crystal] & BoardField::ColorMask);
+                Color lightColor = (Color)(lightMap[crystal] & Light::ColorMask) | first.color;
+
+                if (lightColor == crystalColor || (lightColor & ~crystalColor) != Color::Empty)
                     continue;
 
-                preMoves.movesCount = 0;
-                if ((board[mp] & BoardField::ObjectMask) == BoardField::Empty)
+                // Cells lit by the first lantern can't take the second one
+                if (litStamps[firstMp] != stamp)
                 {
-                    if ((lightMap[mp] & Light::ColorMask) == Light::Empty)
-                    {
-                        // See if any crystal can be hit from this position in the map
-                        Color color = (Color)(crystalsLightMap[mp] & Light::ColorMask);
+                    litStamps[firstMp] = stamp;
+                    WalkRays(first.position.x, first.position.y, [&](mpos mp) { litStamps[mp] = stamp; });
+                }
 
-                        if (color == Color::Empty)
-                            continue;
+                Lantern second;
 
-                        Lantern lantern;
-                        lantern.position.x = x;
-                        lantern.position.y = y;
+                second.color = crystalColor & ~lightColor;
+                WalkRays(crystal % width, crystal / width, [&](mpos mp)
+                {
+                    if ((board[mp] & BoardField::ObjectMask) != BoardField::Empty || (lightMap[mp] & Light::ColorMask) != Light::Empty || litStamps[mp] == stamp)
+                        return;
 
-                        // Try putting lantern
-                        if ((color & Color::Blue) != Color::Empty)
-                        {
-                            lantern.color = Color::Blue;
-                            preMoves.moves[preMoves.movesCount++] = Move(this, lantern, costLantern);
-                        }
-                        if ((color & Color::Yellow) != Color::Empty)
-                        {
-                            lantern.color = Color::Yellow;
-                            preMoves.moves[preMoves.movesCount++] = Move(this, lantern, costLantern);
-                        }
-                        if ((color & Color::Red) != Color::Empty)
-                        {
-                            lantern.color = Color::Red;
-                            preMoves.moves[preMoves.movesCount++] = Move(this, lantern, costLantern);
-                        }
-                    }
-                    else
-                    {
-                        // Try to put Obstacle
-                        if ((int)obstacles.size() < maxObstacles)
-                        {
-                            Obstacle obstacle;
-                            obstacle.position.x = x;
-                            obstacle.position.y = y;
-                            preMoves.moves[preMoves.movesCount++] = Move(this, obstacle, costObstacle);
-                        }
+                    int score, potentialScore;
 
-                        // Try to put slash Mirror '/'
-                        if ((int)mirrors.size() >= maxMirrors)
-                            continue;
-                        Mirror mirror;
-                        mirror.position.x = x;
-                        mirror.position.y = y;
-                        mirror.slash = true;
+                    second.position.x = mp % width;
+                    second.position.y = mp / width;
+                    GetLanternPairScore(first, firstCrystals, second, costLantern, score, potentialScore);
 
-                        if (IsPuttingMirrorSafe(mirror))
-                            preMoves.moves[preMoves.movesCount++] = Move(this, mirror, costMirror);
+                    Move pair(this, first, second, score, potentialScore);
 
-                        // Try to put backslash Mirror '\'
-                        mirror.slash = false;
-                        if (IsPuttingMirrorSafe(mirror))
-                            preMoves.moves[preMoves.movesCount++] = Move(this, mirror, costMirror);
-                    }
-                }
+                    if (best.state == nullptr || Ranking::Rank(pair) > Ranking::Rank(best))
+                        best = pair;
+                });
             }
+            if (best.state != nullptr)
+                moves.push_back(best);
+        }
     }
 
-    void PutLantern(Lantern lantern, int cost)
+    // Calls visit for every cell lit by lantern put at x, y
+    template<class Visit>
+    void WalkRays(coord x, coord y, Visit visit)
     {
-        int16 mp = lantern.position.y * width + lantern.position.x;
-        UpdateScore(AddColorLeft(lantern.position.x - 1, lantern.position.y, mp - 1, width, lantern.color, lightMap, board));
-        UpdateScore(AddColorRight(lantern.position.x + 1, lantern.position.y, mp + 1, width, lantern.color, lightMap, board));
-        UpdateScore(AddColorUp(lantern.position.x, lantern.position.y - 1, mp - width, width, lantern.color, lightMap, board));
-        UpdateScore(AddColorDown(lantern.position.x, lantern.position.y + 1, mp + width, width, lantern.color, lightMap, board));
-
-        // Update crystalsLightMap
-        ClearColorLeft(lantern.position.x - 1, lantern.position.y, mp - 1, width, crystalsLightMap, board);
-        ClearColorRight(lantern.position.x + 1, lantern.position.y, mp + 1, width, crystalsLightMap, board);
-        ClearColorUp(lantern.position.x, lantern.position.y - 1, mp - width, width, crystalsLightMap, board);
-        ClearColorDown(lantern.position.x, lantern.position.y + 1, mp + width, width, crystalsLightMap, board);
+        static const int8 directions[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+        mpos start = y * width + x;
 
-        // Update crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown
-        UpdateMapLeft(lantern.position.x - 1, lantern.position.y, mp - 1, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapRight(lantern.position.x + 1, lantern.position.y, mp + 1, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapUp(lantern.position.x, lantern.position.y - 1, mp - width, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapDown(lantern.position.x, lantern.position.y + 1, mp + width, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        for (auto& direction : directions)
+        {
+            int dx = direction[0], dy = direction[1];
+            int cx = x + dx, cy = y + dy;
 
-        // Mark as invalid precalculated moves
-        precalculatedMoves[mp].movesCount = -1;
-        InvalidatePreMovesLeft(lantern.position.x - 1, lantern.position.y, mp - 1, width, precalculatedMoves, board);
-        InvalidatePreMovesRight(lantern.position.x + 1, lantern.position.y, mp + 1, width, precalculatedMoves, board);
-        InvalidatePreMovesUp(lantern.position.x, lantern.position.y - 1, mp - width, width, precalculatedMoves, board);
-        InvalidatePreMovesDown(lantern.position.x, lantern.position.y + 1, mp + width, width, precalculatedMoves, board);
+            while (cx >= 0 && cx < width && cy >= 0 && cy < height)
+            {
+                mpos mp = cy * width + cx;
+                BoardField field = board[mp];
 
-        // Update rest of the fields
-        score -= cost;
-        potentialScore -= cost;
-        board[mp] |= BoardField::Lantern | (BoardField)(lantern.color);
-        lanterns.push_back(lantern);
-        hash = hash ^ lantern.GetHash();
+                if (mp == start)
+                    break;
+                visit(mp);
+                if ((field & BoardField::MirrorSlash) != BoardField::Empty)
+                {
+                    int t = dx;
+                    dx = -dy;
+                    dy = -t;
+                }
+                else if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
+                    std::swap(dx, dy);
+                else if ((field & BoardField::ObjectMask) != BoardField::Empty)
+                    break;
+                cx += dx;
+                cy += dy;
+            }
+        }
     }
 
-    void PutObstacle(Obstacle obstacle, int cost)
+    template<class Ranking>
+    void UpdateMoves(int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+#ifdef USE_PARALLEL_MOVES
+        if (dirtyCellsCount >= PARALLEL_MOVES_MIN_CELLS && !ThreadPool::Disabled() && ThreadPool::Instance().ThreadsCount() > 1)
+        {
+            // Cells only share candidate buckets: unlink all cells, calculate them in parallel and link them
+            // in the same order as the serial loop below does
+            for (mpos i = 0; i < dirtyCellsCount; i++)
+                UnindexMoves<Ranking>(dirtyCells[i]);
+            ThreadPool::Instance().ParallelFor(dirtyCellsCount, PARALLEL_MOVES_CHUNK, [&](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    mpos mp = dirtyCells[i];
+
+                    CalculateMoves(mp, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+                }
+            });
+            while (dirtyCellsCount > 0)
+                IndexMoves<Ranking>(dirtyCells[--dirtyCellsCount]);
+            return;
+        }
+#endif
+
+        // Only cells invalidated since the last update need to be recalculated
+        while (dirtyCellsCount > 0)
+        {
+            mpos mp = dirtyCells[--dirtyCellsCount];
+
+            UnindexMoves<Ranking>(mp);
+            CalculateMoves(mp, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+            IndexMoves<Ranking>(mp);
+        }
+    }
+
+    void CalculateMoves(mpos mp, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        PrecalculatedMoves& preMoves = precalculatedMoves[mp];
+
+        preMoves.movesCount = 0;
+        if ((board[mp] & BoardField::ObjectMask) != BoardField::Empty)
+            return;
+        if (!CanLightUnsatisfiedCrystal(mp))
+            return;
+
+        // Most invalidated cells end above, so the position is divided out of mp only for cells with moves
+        coord x = mp % width;
+        coord y = mp / width;
+
+        BoardField useful = GetUsefulMoves(mp);
+
+        if ((lightMap[mp] & Light::ColorMask) == Light::Empty)
+        {
+            // See if any crystal can be hit from this position in the map
+            Color color = (Color)(crystalsLightMap[mp] & Light::ColorMask) & (Color)(useful & BoardField::ColorMask);
+
+            if (color == Color::Empty)
+                return;
+
+            Lantern lantern;
+            lantern.position.x = x;
+            lantern.position.y = y;
+
+            // Try putting lantern, all colors are scored at once
+            int scores[3], potentialScores[3];
+
+            GetLanternScores(mp, costLantern, scores, potentialScores);
+            if ((color & Color::Blue) != Color::Empty)
+            {
+                lantern.color = Color::Blue;
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, lantern, scores[0], potentialScores[0]);
+            }
+            if ((color & Color::Yellow) != Color::Empty)
+            {
+                lantern.color = Color::Yellow;
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, lantern, scores[1], potentialScores[1]);
+            }
+            if ((color & Color::Red) != Color::Empty)
+            {
+                lantern.color = Color::Red;
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, lantern, scores[2], potentialScores[2]);
+            }
+        }
+        else
+        {
+            // Try to put Obstacle
+            if (obstaclesCount < maxObstacles && (useful & BoardField::Obstacle) != BoardField::Empty)
+            {
+                Obstacle obstacle;
+                obstacle.position.x = x;
+                obstacle.position.y = y;
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, obstacle, costObstacle);
+            }
+
+            // Try to put slash Mirror '/'
+            if (mirrorsCount >= maxMirrors)
+                return;
+            Mirror mirror;
+            mirror.position.x = x;
+            mirror.position.y = y;
+            mirror.slash = true;
+
+            if (IsPuttingMirrorSafe(mirror))
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, mirror, costMirror);
+
+            // Try to put backslash Mirror '\'
+            mirror.slash = false;
+            if (IsPuttingMirrorSafe(mirror))
+                preMoves.moves[(int)preMoves.movesCount++] = Move(this, mirror, costMirror);
+        }
+    }
+
+    // Cells are indexed by crystals that can be lit from them (crystalsFrom* maps). Moves in cells that can
+    // light only crystals that already have their color can only lose score, so they are not generated.
+    bool CanLightUnsatisfiedCrystal(mpos mp)
+    {
+        return IsUnsatisfiedCrystal(crystalsFromLeft[mp]) || IsUnsatisfiedCrystal(crystalsFromRight[mp])
+            || IsUnsatisfiedCrystal(crystalsFromUp[mp]) || IsUnsatisfiedCrystal(crystalsFromDown[mp]);
+    }
+
+    bool IsUnsatisfiedCrystal(mpos crystal)
+    {
+        return crystal >= 0 && (Color)(lightMap[crystal] & Light::ColorMask) != (Color)(board[crystal] & BoardField::ColorMask);
+    }
+
+    // Lantern colors and obstacle that can pay off in the cell, see MarkUsefulMoves
+    static BoardField GetUsefulMoves(mpos mp)
+    {
+        return usefulMoves.empty() ? BoardField::ColorMask | BoardField::Obstacle : usefulMoves[mp];
+    }
+
+    // Marks moves that can pay off in some state of the input board. Without mirrors, a lantern changes only
+    // the crystals at the ends of its four rays and an obstacle only the crystals its rays were going to, so
+    // a move is useless if its cost is not below the most these crystals can gain. Obstacle that can stand
+    // between two cells where lanterns can be placed is kept, as it can make the second lantern legal.
+    static void MarkUsefulMoves(const State& inputState, int costLantern, int costObstacle, int maxMirrors)
+    {
+        static const int directions[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } }; // Opposite directions are pairs
+        static const Color colors[3] = { Color::Blue, Color::Yellow, Color::Red };
+        int width = inputState.width, height = inputState.height;
+
+        usefulMoves.clear();
+        if (maxMirrors > 0)
+            return;
+        usefulMoves.assign(width * height, BoardField::Empty);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                if ((inputState.board[y * width + x] & BoardField::ObjectMask) != BoardField::Empty)
+                    continue;
+
+                bool hasEmptyCell[4];
+                mpos crystal[4];
+
+                for (int d = 0; d < 4; d++)
+                {
+                    int cx = x + directions[d][0], cy = y + directions[d][1];
+
+                    hasEmptyCell[d] = false;
+                    crystal[d] = -1;
+                    for (; cx >= 0 && cx < width && cy >= 0 && cy < height; cx += directions[d][0], cy += directions[d][1])
+                    {
+                        BoardField field = inputState.board[cy * width + cx];
+
+                        if ((field & BoardField::Crystal) != BoardField::Empty)
+                            crystal[d] = cy * width + cx;
+                        if ((field & BoardField::ObjectMask) != BoardField::Empty)
+                            break;
+                        hasEmptyCell[d] = true;
+                    }
+                }
+
+                int lanternGains[3] = { 0, 0, 0 }, obstacleGain = 0;
+                bool separatesLanterns = false;
+
+                for (int d = 0; d < 4; d++)
+                {
+                    if (crystal[d] < 0)
+                        continue;
+
+                    Color crystalColor = (Color)(inputState.board[crystal[d]] & BoardField::ColorMask);
+                    int lanternGain[3] = { 0, 0, 0 }, obstacleCrystalGain = 0;
+
+                    for (int previous = 0; previous < 8; previous++)
+                    {
+                        for (int c = 0; c < 3; c++)
+                            lanternGain[c] = std::max(lanternGain[c], crystalScoreDiffs.score[(int)crystalColor][previous][previous | (int)colors[c]]);
+                        for (int next = 0; next < 8; next++)
+                            if ((next & previous) == next)
+                                obstacleCrystalGain = std::max(obstacleCrystalGain, crystalScoreDiffs.score[(int)crystalColor][previous][next]);
+                    }
+                    for (int c = 0; c < 3; c++)
+                        lanternGains[c] += lanternGain[c];
+
+                    // Light going to the crystal through this cell comes from the other side
+                    if (hasEmptyCell[d ^ 1])
+                        obstacleGain += obstacleCrystalGain;
+                }
+                for (int d = 0; d < 4; d++)
+                    separatesLanterns = separatesLanterns || (hasEmptyCell[d] && hasEmptyCell[d ^ 1]);
+
+                BoardField useful = BoardField::Empty;
+
+                for (int c = 0; c < 3; c++)
+                    if (lanternGains[c] > costLantern)
+                        useful = useful | (BoardField)colors[c];
+                if (separatesLanterns || obstacleGain > costObstacle)
+                    useful = useful | BoardField::Obstacle;
+                usefulMoves[y * width + x] = useful;
+            }
+    }
+
+    template<class Ranking>
+    void IndexMoves(mpos mp)
+    {
+        PrecalculatedMoves& preMoves = precalculatedMoves[mp];
+
+        for (int i = 0; i < preMoves.movesCount; i++)
+        {
+            int16 bucket = GetCandidateBucket<Ranking>(preMoves.moves[i]);
+            mpos candidate = mp * 3 + i;
+            mpos head = candidateBuckets[bucket];
+
+            preMoves.previousCandidate[i] = -1;
+            preMoves.nextCandidate[i] = head;
+            if (head >= 0)
+                precalculatedMoves[head / 3].previousCandidate[head % 3] = candidate;
+            candidateBuckets[bucket] = candidate;
+            if (bucket > topCandidateBucket)
+                topCandidateBucket = bucket;
+        }
+        preMoves.indexedCount = preMoves.movesCount;
+    }
+
+    template<class Ranking>
+    void UnindexMoves(mpos mp)
+    {
+        PrecalculatedMoves& preMoves = precalculatedMoves[mp];
+
+        for (int i = 0; i < preMoves.indexedCount; i++)
+        {
+            mpos previous = preMoves.previousCandidate[i];
+            mpos next = preMoves.nextCandidate[i];
+
+            if (previous >= 0)
+                precalculatedMoves[previous / 3].nextCandidate[previous % 3] = next;
+            else
+                candidateBuckets[GetCandidateBucket<Ranking>(preMoves.moves[i])] = next;
+            if (next >= 0)
+                precalculatedMoves[next / 3].previousCandidate[next % 3] = previous;
+        }
+        preMoves.indexedCount = 0;
+    }
+
+    void GetAllMoves(vector<Move>& moves, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        mpos mp = 0;
+
+        moves.clear();
+        for (coord y = 0; y < height; y++)
+            for (coord x = 0; x < width; x++, mp++)
+                if ((board[mp] & BoardField::ObjectMask) == BoardField::Empty)
+                {
+                    BoardField useful = GetUsefulMoves(mp);
+
+                    if ((lightMap[mp] & Light::ColorMask) == Light::Empty)
+                    {
+                        // See if any crystal can be hit from this position in the map
+                        Color color = (Color)(crystalsLightMap[mp] & Light::ColorMask) & (Color)(useful & BoardField::ColorMask);
+
+                        if (color == Color::Empty)
+                            continue;
+
+                        Lantern lantern;
+                        lantern.position.x = x;
+                        lantern.position.y = y;
+
+                        // Try putting lantern, all colors are scored at once
+                        int scores[3], potentialScores[3];
+
+                        GetLanternScores(mp, costLantern, scores, potentialScores);
+                        if ((color & Color::Blue) != Color::Empty)
+                        {
+                            lantern.color = Color::Blue;
+                            moves.push_back(Move(this, lantern, scores[0], potentialScores[0]));
+                        }
+                        if ((color & Color::Yellow) != Color::Empty)
+                        {
+                            lantern.color = Color::Yellow;
+                            moves.push_back(Move(this, lantern, scores[1], potentialScores[1]));
+                        }
+                        if ((color & Color::Red) != Color::Empty)
+                        {
+                            lantern.color = Color::Red;
+                            moves.push_back(Move(this, lantern, scores[2], potentialScores[2]));
+                        }
+                    }
+                    else
+                    {
+                        // Try to put Obstacle
+                        if (obstaclesCount < maxObstacles && (useful & BoardField::Obstacle) != BoardField::Empty)
+                        {
+                            Obstacle obstacle;
+                            obstacle.position.x = x;
+                            obstacle.position.y = y;
+                            moves.push_back(Move(this, obstacle, costObstacle));
+                        }
+
+                        // Try to put slash Mirror '/'
+                        if (mirrorsCount >= maxMirrors)
+                            continue;
+                        Mirror mirror;
+                        mirror.position.x = x;
+                        mirror.position.y = y;
+                        mirror.slash = true;
+
+                        if (IsPuttingMirrorSafe(mirror))
+                            moves.push_back(Move(this, mirror, costMirror));
+
+                        // Try to put backslash Mirror '\'
+                        mirror.slash = false;
+                        if (IsPuttingMirrorSafe(mirror))
+                            moves.push_back(Move(this, mirror, costMirror));
+                    }
+                }
+    }
+
+    void PutLantern(Lantern lantern, int cost)
+    {
+        DispatchStride([&](auto stride) { PutLanternWithStride<decltype(stride)::value>(lantern, cost); });
+    }
+
+    void PutObstacle(Obstacle obstacle, int cost)
+    {
+        DispatchStride([&](auto stride) { PutObstacleWithStride<decltype(stride)::value>(obstacle, cost); });
+    }
+
+    void PutMirror(Mirror mirror, int cost)
+    {
+        DispatchStride([&](auto stride) { PutMirrorWithStride<decltype(stride)::value>(mirror, cost); });
+    }
+
+    template<coord Stride>
+    void PutLanternWithStride(Lantern lantern, int cost)
+    {
+        coord stride = RowStride<Stride>(width);
+        mpos mp = lantern.position.y * stride + lantern.position.x;
+        UpdateScore<Stride>(AddColorLeft<Stride>(lantern.position.x - 1, lantern.position.y, mp - 1, stride, lantern.color, lightMap, board));
+        UpdateScore<Stride>(AddColorRight<Stride>(lantern.position.x + 1, lantern.position.y, mp + 1, stride, lantern.color, lightMap, board));
+        UpdateScore<Stride>(AddColorUp<Stride>(lantern.position.x, lantern.position.y - 1, mp - stride, stride, lantern.color, lightMap, board));
+        UpdateScore<Stride>(AddColorDown<Stride>(lantern.position.x, lantern.position.y + 1, mp + stride, stride, lantern.color, lightMap, board));
+
+        // Update crystalsLightMap
+        ClearColorLeft<Stride>(lantern.position.x - 1, lantern.position.y, mp - 1, stride, crystalsLightMap, board);
+        ClearColorRight<Stride>(lantern.position.x + 1, lantern.position.y, mp + 1, stride, crystalsLightMap, board);
+        ClearColorUp<Stride>(lantern.position.x, lantern.position.y - 1, mp - stride, stride, crystalsLightMap, board);
+        ClearColorDown<Stride>(lantern.position.x, lantern.position.y + 1, mp + stride, stride, crystalsLightMap, board);
+
+        // Update crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown
+        UpdateMapLeft<Stride>(lantern.position.x - 1, lantern.position.y, mp - 1, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapRight<Stride>(lantern.position.x + 1, lantern.position.y, mp + 1, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapUp<Stride>(lantern.position.x, lantern.position.y - 1, mp - stride, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapDown<Stride>(lantern.position.x, lantern.position.y + 1, mp + stride, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+
+        // Mark as invalid precalculated moves
+        InvalidatePreMove(mp, precalculatedMoves, dirtyCells, dirtyCellsCount);
+        InvalidatePreMovesLeft<Stride>(lantern.position.x - 1, lantern.position.y, mp - 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesRight<Stride>(lantern.position.x + 1, lantern.position.y, mp + 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesUp<Stride>(lantern.position.x, lantern.position.y - 1, mp - stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesDown<Stride>(lantern.position.x, lantern.position.y + 1, mp + stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+
+        // Update rest of the fields
+        score -= cost;
+        potentialScore -= cost;
+        board[mp] |= BoardField::Lantern | (BoardField)(lantern.color);
+        ItemNode* node = ItemArena::Allocate(items, MoveType::Lantern);
+        node->lantern = lantern;
+        items = node;
+        lanternsCount++;
+        hash = hash ^ lantern.GetHash();
+    }
+
+    template<coord Stride>
+    void PutObstacleWithStride(Obstacle obstacle, int cost)
     {
-        int16 mp = obstacle.position.y * width + obstacle.position.x;
+        coord stride = RowStride<Stride>(width);
+        mpos mp = obstacle.position.y * stride + obstacle.position.x;
 
-        ClearColor(obstacle.position);
+        ClearColor<Stride>(obstacle.position);
         score -= cost;
         potentialScore -= cost;
-        obstacles.push_back(obstacle);
+        ItemNode* node = ItemArena::Allocate(items, MoveType::Obstacle);
+        node->obstacle = obstacle;
+        items = node;
+        obstaclesCount++;
         board[mp] |= BoardField::Obstacle;
         hash = hash ^ obstacle.GetHash();
     }
 
-    void PutMirror(Mirror mirror, int cost)
+    template<coord Stride>
+    void PutMirrorWithStride(Mirror mirror, int cost)
     {
-        int16 mp = mirror.position.y * width + mirror.position.x;
+        coord stride = RowStride<Stride>(width);
+        mpos mp = mirror.position.y * stride + mirror.position.x;
         Light light = lightMap[mp];
         Light crystalsLight = crystalsLightMap[mp];
 
-        ClearColor(mirror.position);
+        ClearColor<Stride>(mirror.position);
         if (mirror.slash)
         {
             if ((light & Light::LeftMask) != Light::Empty)
-                UpdateScore(AddColorDown(mirror.position.x, mirror.position.y + 1, mp + width, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, GetLeftColor(light), lightMap, board));
             if ((light & Light::RightMask) != Light::Empty)
-                UpdateScore(AddColorUp(mirror.position.x, mirror.position.y - 1, mp - width, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, GetRightColor(light), lightMap, board));
             if ((light & Light::DownMask) != Light::Empty)
-                UpdateScore(AddColorLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, GetDownColor(light), lightMap, board));
             if ((light & Light::UpMask) != Light::Empty)
-                UpdateScore(AddColorRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, GetUpColor(light), lightMap, board));
             if ((crystalsLight & Light::LeftMask) != Light::Empty)
-                AddColorDown(mirror.position.x, mirror.position.y + 1, mp + width, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, GetLeftColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::RightMask) != Light::Empty)
-                AddColorUp(mirror.position.x, mirror.position.y - 1, mp - width, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, GetRightColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::DownMask) != Light::Empty)
-                AddColorLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, GetDownColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::UpMask) != Light::Empty)
-                AddColorRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, GetUpColor(crystalsLight), crystalsLightMap, board);
             if (crystalsFromLeft[mp] >= 0)
-                UpdateMapUp(mirror.position.x, mirror.position.y - 1, mp - width, width, crystalsFromLeft[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, crystalsFromLeft[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromRight[mp] >= 0)
-                UpdateMapDown(mirror.position.x, mirror.position.y + 1, mp + width, width, crystalsFromRight[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, crystalsFromRight[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromUp[mp] >= 0)
-                UpdateMapLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, crystalsFromUp[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, crystalsFromUp[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromDown[mp] >= 0)
-                UpdateMapRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, crystalsFromDown[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, crystalsFromDown[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
         }
         else
         {
             if ((light & Light::LeftMask) != Light::Empty)
-                UpdateScore(AddColorUp(mirror.position.x, mirror.position.y - 1, mp - width, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, GetLeftColor(light), lightMap, board));
             if ((light & Light::RightMask) != Light::Empty)
-                UpdateScore(AddColorDown(mirror.position.x, mirror.position.y + 1, mp + width, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, GetRightColor(light), lightMap, board));
             if ((light & Light::DownMask) != Light::Empty)
-                UpdateScore(AddColorRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, GetDownColor(light), lightMap, board));
             if ((light & Light::UpMask) != Light::Empty)
-                UpdateScore(AddColorLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, GetLeftColor(light), lightMap, board));
+                UpdateScore<Stride>(AddColorLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, GetUpColor(light), lightMap, board));
             if ((crystalsLight & Light::LeftMask) != Light::Empty)
-                AddColorUp(mirror.position.x, mirror.position.y - 1, mp - width, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, GetLeftColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::RightMask) != Light::Empty)
-                AddColorDown(mirror.position.x, mirror.position.y + 1, mp + width, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, GetRightColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::DownMask) != Light::Empty)
-                AddColorRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, GetDownColor(crystalsLight), crystalsLightMap, board);
             if ((crystalsLight & Light::UpMask) != Light::Empty)
-                AddColorLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, GetLeftColor(crystalsLight), crystalsLightMap, board);
+                AddColorLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, GetUpColor(crystalsLight), crystalsLightMap, board);
             if (crystalsFromLeft[mp] >= 0)
-                UpdateMapDown(mirror.position.x, mirror.position.y + 1, mp + width, width, crystalsFromLeft[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapDown<Stride>(mirror.position.x, mirror.position.y + 1, mp + stride, stride, crystalsFromLeft[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromRight[mp] >= 0)
-                UpdateMapUp(mirror.position.x, mirror.position.y - 1, mp - width, width, crystalsFromRight[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapUp<Stride>(mirror.position.x, mirror.position.y - 1, mp - stride, stride, crystalsFromRight[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromUp[mp] >= 0)
-                UpdateMapRight(mirror.position.x + 1, mirror.position.y, mp + 1, width, crystalsFromUp[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapRight<Stride>(mirror.position.x + 1, mirror.position.y, mp + 1, stride, crystalsFromUp[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
             if (crystalsFromDown[mp] >= 0)
-                UpdateMapLeft(mirror.position.x - 1, mirror.position.y, mp - 1, width, crystalsFromDown[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+                UpdateMapLeft<Stride>(mirror.position.x - 1, mirror.position.y, mp - 1, stride, crystalsFromDown[mp], crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
         }
 
         score -= cost;
         potentialScore -= cost;
-        mirrors.push_back(mirror);
+        ItemNode* node = ItemArena::Allocate(items, MoveType::Mirror);
+        node->mirror = mirror;
+        items = node;
+        mirrorsCount++;
         board[mp] |= mirror.slash ? BoardField::MirrorSlash : BoardField::MirrorBackSlash;
         hash = hash ^ mirror.GetHash();
     }
 
-    void GetLanternScore(Lantern lantern, int cost, int& score, int& potentialScore)
+    void GetLanternScore(Lantern lantern, int cost, int16& score, int16& potentialScore)
     {
         score = -cost;
         potentialScore = -cost;
 
-        int16 lmp = lantern.position.y * width + lantern.position.x;
+        mpos lmp = lantern.position.y * width + lantern.position.x;
         Light crystalLights = crystalsLightMap[lmp];
 
         if ((crystalLights & Light::LeftMask) != Light::Empty)
         {
-            int16 mp = crystalsFromRight[lmp];
+            mpos mp = crystalsFromRight[lmp];
             if (mp >= 0)
             {
                 Color previousColor = (Color)(lightMap[mp] & Light::ColorMask);
@@ -734,7 +2183,7 @@ struct State
         }
         if ((crystalLights & Light::RightMask) != Light::Empty)
         {
-            int16 mp = crystalsFromLeft[lmp];
+            mpos mp = crystalsFromLeft[lmp];
             if (mp >= 0)
             {
                 Color previousColor = (Color)(lightMap[mp] & Light::ColorMask);
@@ -750,7 +2199,7 @@ struct State
         }
         if ((crystalLights & Light::DownMask) != Light::Empty)
         {
-            int16 mp = crystalsFromUp[lmp];
+            mpos mp = crystalsFromUp[lmp];
             if (mp >= 0)
             {
                 Color previousColor = (Color)(lightMap[mp] & Light::ColorMask);
@@ -766,7 +2215,7 @@ struct State
         }
         if ((crystalLights & Light::UpMask) != Light::Empty)
         {
-            int16 mp = crystalsFromDown[lmp];
+            mpos mp = crystalsFromDown[lmp];
             if (mp >= 0)
             {
                 Color previousColor = (Color)(lightMap[mp] & Light::ColorMask);
@@ -782,17 +2231,100 @@ struct State
         }
     }
 
-    void GetObstacleScore(Obstacle obstacle, int cost, int& score, int& potentialScore)
+    // Crystals lit by lantern put at lmp, -1 in directions without crystal
+    void GetLanternCrystals(mpos lmp, mpos crystals[4])
+    {
+        Light crystalLights = crystalsLightMap[lmp];
+
+        crystals[0] = (crystalLights & Light::LeftMask) != Light::Empty ? crystalsFromRight[lmp] : (mpos)-1;
+        crystals[1] = (crystalLights & Light::RightMask) != Light::Empty ? crystalsFromLeft[lmp] : (mpos)-1;
+        crystals[2] = (crystalLights & Light::DownMask) != Light::Empty ? crystalsFromUp[lmp] : (mpos)-1;
+        crystals[3] = (crystalLights & Light::UpMask) != Light::Empty ? crystalsFromDown[lmp] : (mpos)-1;
+    }
+
+    // Scores of blue, yellow and red lantern in the cell. Crystals lit from the cell are read once for all colors
+    // and score differences come from the table, so this is cheaper than three GetLanternScore calls.
+    void GetLanternScores(mpos lmp, int cost, int scores[3], int potentialScores[3])
+    {
+        static const Color colors[3] = { Color::Blue, Color::Yellow, Color::Red };
+        mpos crystals[4];
+
+        GetLanternCrystals(lmp, crystals);
+
+        for (int i = 0; i < 3; i++)
+        {
+            scores[i] = -cost;
+            potentialScores[i] = -cost;
+        }
+        for (mpos mp : crystals)
+            if (mp >= 0)
+            {
+                int previousColor = (int)(lightMap[mp] & Light::ColorMask);
+                int crystalColor = (int)(board[mp] & BoardField::ColorMask);
+
+                for (int i = 0; i < 3; i++)
+                {
+                    int newColor = previousColor | (int)colors[i];
+
+                    scores[i] += crystalScoreDiffs.score[crystalColor][previousColor][newColor];
+                    potentialScores[i] += crystalScoreDiffs.potentialScore[crystalColor][previousColor][newColor];
+                }
+            }
+    }
+
+    // Scores two lanterns put at once. Lanterns must not light each other, so their rays are the same as
+    // when they are put alone and only crystals lit by both of them need to be scored together.
+    void GetLanternPairScore(Lantern first, const mpos firstCrystals[4], Lantern second, int cost, int& score, int& potentialScore)
+    {
+        mpos crystals[8];
+        Color colors[8];
+        int crystalsCount = 0;
+        mpos secondCrystals[4];
+
+        GetLanternCrystals(second.position.y * width + second.position.x, secondCrystals);
+        for (int i = 0; i < 8; i++)
+        {
+            mpos crystal = i < 4 ? firstCrystals[i] : secondCrystals[i - 4];
+            Color color = i < 4 ? first.color : second.color;
+            int j = 0;
+
+            if (crystal < 0)
+                continue;
+            while (j < crystalsCount && crystals[j] != crystal)
+                j++;
+            if (j == crystalsCount)
+            {
+                crystals[crystalsCount] = crystal;
+                colors[crystalsCount++] = color;
+            }
+            else
+                colors[j] |= color;
+        }
+
+        score = -2 * cost;
+        potentialScore = -2 * cost;
+        for (int i = 0; i < crystalsCount; i++)
+        {
+            int previousColor = (int)(lightMap[crystals[i]] & Light::ColorMask);
+            int crystalColor = (int)(board[crystals[i]] & BoardField::ColorMask);
+            int newColor = previousColor | (int)colors[i];
+
+            score += crystalScoreDiffs.score[crystalColor][previousColor][newColor];
+            potentialScore += crystalScoreDiffs.potentialScore[crystalColor][previousColor][newColor];
+        }
+    }
+
+    void GetObstacleScore(Obstacle obstacle, int cost, int16& score, int16& potentialScore)
     {
         score = -cost;
         potentialScore = -cost;
 
-        int16 lmp = obstacle.position.y * width + obstacle.position.x;
+        mpos lmp = obstacle.position.y * width + obstacle.position.x;
         Light lights = lightMap[lmp];
 
         if ((lights & Light::LeftMask) != Light::Empty)
         {
-            int16 mp = crystalsFromLeft[lmp];
+            mpos mp = crystalsFromLeft[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -812,7 +2344,7 @@ struct State
         }
         if ((lights & Light::RightMask) != Light::Empty)
         {
-            int16 mp = crystalsFromRight[lmp];
+            mpos mp = crystalsFromRight[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -832,7 +2364,7 @@ struct State
         }
         if ((lights & Light::UpMask) != Light::Empty)
         {
-            int16 mp = crystalsFromUp[lmp];
+            mpos mp = crystalsFromUp[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -852,7 +2384,7 @@ struct State
         }
         if ((lights & Light::DownMask) != Light::Empty)
         {
-            int16 mp = crystalsFromDown[lmp];
+            mpos mp = crystalsFromDown[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -872,20 +2404,20 @@ struct State
         }
     }
 
-    void GetMirrorScore(Mirror mirror, int cost, int& score, int& potentialScore)
+    void GetMirrorScore(Mirror mirror, int cost, int16& score, int16& potentialScore)
     {
         score = -cost;
         potentialScore = -cost;
 
         // Slash: Left -> Down, Right -> Up, Down -> Left, Up -> Right
         // BackSlash: Left -> Up, Right -> Down, Up -> Left, Down -> Right
-        int16 lmp = mirror.position.y * width + mirror.position.x;
+        mpos lmp = mirror.position.y * width + mirror.position.x;
         Light lights = lightMap[lmp];
         Light crystalLights = crystalsLightMap[lmp];
 
         if ((crystalLights & Light::LeftMask) != Light::Empty)
         {
-            int16 mp = crystalsFromRight[lmp];
+            mpos mp = crystalsFromRight[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -915,7 +2447,7 @@ struct State
         }
         if ((crystalLights & Light::RightMask) != Light::Empty)
         {
-            int16 mp = crystalsFromLeft[lmp];
+            mpos mp = crystalsFromLeft[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -945,7 +2477,7 @@ struct State
         }
         if ((crystalLights & Light::UpMask) != Light::Empty)
         {
-            int16 mp = crystalsFromDown[lmp];
+            mpos mp = crystalsFromDown[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -975,7 +2507,7 @@ struct State
         }
         if ((crystalLights & Light::DownMask) != Light::Empty)
         {
-            int16 mp = crystalsFromUp[lmp];
+            mpos mp = crystalsFromUp[lmp];
             if (mp >= 0)
             {
                 Light previousLight = lightMap[mp];
@@ -1007,7 +2539,7 @@ struct State
 
     bool IsPuttingMirrorSafe(Mirror mirror)
     {
-        int16 mp = mirror.position.y * width + mirror.position.x;
+        mpos mp = mirror.position.y * width + mirror.position.x;
         Light light = lightMap[mp];
 
         // Check if it will succeed
@@ -1033,6 +2565,26 @@ struct State
         return true;
     }
 
+    // Crystal score differences indexed by crystal color, previous and new light color
+    struct CrystalScoreDiffs
+    {
+        int score[8][8][8];
+        int potentialScore[8][8][8];
+
+        CrystalScoreDiffs()
+        {
+            for (int crystalColor = 0; crystalColor < 8; crystalColor++)
+                for (int previousColor = 0; previousColor < 8; previousColor++)
+                    for (int newColor = 0; newColor < 8; newColor++)
+                    {
+                        score[crystalColor][previousColor][newColor] = GetCrystalScoreDiff((Color)previousColor, (Color)crystalColor, (Color)newColor);
+                        potentialScore[crystalColor][previousColor][newColor] = GetCrystalPotentialScoreDiff((Color)previousColor, (Color)crystalColor, (Color)newColor);
+                    }
+        }
+    };
+
+    static const CrystalScoreDiffs crystalScoreDiffs;
+
     static int GetCrystalScoreDiff(Color previousColor, Color crystalColor, Color newColor)
     {
         int previousScore = GetCrystalScore(crystalColor, previousColor);
@@ -1080,59 +2632,64 @@ struct State
     }
 
 private:
+    template<coord Stride>
     void ClearColor(Position position)
     {
-        int16 mp = position.y * width + position.x;
+        coord stride = RowStride<Stride>(width);
+        mpos mp = position.y * stride + position.x;
 
-        UpdateScore(ClearColorLeft(position.x - 1, position.y, mp - 1, width, lightMap, board));
-        UpdateScore(ClearColorRight(position.x + 1, position.y, mp + 1, width, lightMap, board));
-        UpdateScore(ClearColorUp(position.x, position.y - 1, mp - width, width, lightMap, board));
-        UpdateScore(ClearColorDown(position.x, position.y + 1, mp + width, width, lightMap, board));
+        UpdateScore<Stride>(ClearColorLeft<Stride>(position.x - 1, position.y, mp - 1, stride, lightMap, board));
+        UpdateScore<Stride>(ClearColorRight<Stride>(position.x + 1, position.y, mp + 1, stride, lightMap, board));
+        UpdateScore<Stride>(ClearColorUp<Stride>(position.x, position.y - 1, mp - stride, stride, lightMap, board));
+        UpdateScore<Stride>(ClearColorDown<Stride>(position.x, position.y + 1, mp + stride, stride, lightMap, board));
 
         // Update crystalsLightMap
-        ClearColorLeft(position.x - 1, position.y, mp - 1, width, crystalsLightMap, board);
-        ClearColorRight(position.x + 1, position.y, mp + 1, width, crystalsLightMap, board);
-        ClearColorUp(position.x, position.y - 1, mp - width, width, crystalsLightMap, board);
-        ClearColorDown(position.x, position.y + 1, mp + width, width, crystalsLightMap, board);
+        ClearColorLeft<Stride>(position.x - 1, position.y, mp - 1, stride, crystalsLightMap, board);
+        ClearColorRight<Stride>(position.x + 1, position.y, mp + 1, stride, crystalsLightMap, board);
+        ClearColorUp<Stride>(position.x, position.y - 1, mp - stride, stride, crystalsLightMap, board);
+        ClearColorDown<Stride>(position.x, position.y + 1, mp + stride, stride, crystalsLightMap, board);
 
         // Update crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown
-        UpdateMapLeft(position.x - 1, position.y, mp - 1, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapRight(position.x + 1, position.y, mp + 1, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapUp(position.x, position.y - 1, mp - width, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
-        UpdateMapDown(position.x, position.y + 1, mp + width, width, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapLeft<Stride>(position.x - 1, position.y, mp - 1, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapRight<Stride>(position.x + 1, position.y, mp + 1, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapUp<Stride>(position.x, position.y - 1, mp - stride, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
+        UpdateMapDown<Stride>(position.x, position.y + 1, mp + stride, stride, -1, crystalsFromLeft, crystalsFromRight, crystalsFromUp, crystalsFromDown, board);
 
         // Mark as invalid precalculated moves
-        precalculatedMoves[mp].movesCount = -1;
-        InvalidatePreMovesLeft(position.x - 1, position.y, mp - 1, width, precalculatedMoves, board);
-        InvalidatePreMovesRight(position.x + 1, position.y, mp + 1, width, precalculatedMoves, board);
-        InvalidatePreMovesUp(position.x, position.y - 1, mp - width, width, precalculatedMoves, board);
-        InvalidatePreMovesDown(position.x, position.y + 1, mp + width, width, precalculatedMoves, board);
+        InvalidatePreMove(mp, precalculatedMoves, dirtyCells, dirtyCellsCount);
+        InvalidatePreMovesLeft<Stride>(position.x - 1, position.y, mp - 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesRight<Stride>(position.x + 1, position.y, mp + 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesUp<Stride>(position.x, position.y - 1, mp - stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        InvalidatePreMovesDown<Stride>(position.x, position.y + 1, mp + stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
     }
 
     struct Hit
     {
-        int8 x;              // x position
-        int8 y;              // y position
-        int16 mp;            // Map position (for direct access to the map)
+        coord x;             // x position
+        coord y;             // y position
+        mpos mp;             // Map position (for direct access to the map)
         Color previousColor; // Previous light color comming from lanterns
         Color crystalColor;  // Color of the crystal
         Color newColor;      // New light color comming from lanterns
+        bool lightChanged;   // Any light direction of the crystal changed
 
-        Hit(int8 x, int8 y, int16 mp)
+        Hit(coord x, coord y, mpos mp)
             : x(x)
             , y(y)
             , mp(mp)
             , crystalColor(Color::Empty)
+            , lightChanged(false)
         {
         }
 
-        Hit(int8 x, int8 y, int16 mp, Color crystalColor, Color previousColor, Color newColor)
+        Hit(coord x, coord y, mpos mp, Color crystalColor, Light previousLight, Light newLight)
             : x(x)
             , y(y)
             , mp(mp)
+            , previousColor((Color)(previousLight & Light::ColorMask))
             , crystalColor(crystalColor)
-            , previousColor(previousColor)
-            , newColor(newColor)
+            , newColor((Color)(newLight & Light::ColorMask))
+            , lightChanged(previousLight != newLight)
         {
         }
 
@@ -1159,16 +2716,54 @@ private:
         }
     };
 
+    template<coord Stride>
     void UpdateScore(Hit hit)
     {
+        coord stride = RowStride<Stride>(width);
         score += hit.GetScore();
         potentialScore += hit.GetPotentialScore();
+        if (hit.crystalColor != Color::Empty)
+            litCrystals += (hit.newColor == hit.crystalColor) - (hit.previousColor == hit.crystalColor);
+
+        // Moves of cells that can light the crystal depend on its light, so they are invalid only if it changed
+        if (hit.lightChanged)
+        {
+            InvalidatePreMovesLeft<Stride>(hit.x - 1, hit.y, hit.mp - 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+            InvalidatePreMovesRight<Stride>(hit.x + 1, hit.y, hit.mp + 1, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+            InvalidatePreMovesUp<Stride>(hit.x, hit.y - 1, hit.mp - stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+            InvalidatePreMovesDown<Stride>(hit.x, hit.y + 1, hit.mp + stride, stride, precalculatedMoves, dirtyCells, dirtyCellsCount, board);
+        }
+    }
+
+    static mpos boardSize;
+
+    // Calls action with the board width as compile-time row stride if tracers are instantiated for it,
+    // otherwise with stride 0, whose tracers use the run-time width
+    template<class Action>
+    void DispatchStride(Action action)
+    {
+#ifdef USE_FIXED_STRIDE_TRACERS
+        // Board widths are spread evenly over 10-100, so only the widest boards with the longest walks get own tracers
+        switch (width)
+        {
+        case MAX_BOARD_SIZE:
+            return action(integral_constant<coord, MAX_BOARD_SIZE>());
+        }
+#endif
+        action(integral_constant<coord, 0>());
     }
 
-    static int16 boardSize;
+    template<coord Stride>
+    static coord RowStride(coord width)
+    {
+        return Stride != 0 ? Stride : width;
+    }
 
-    static void UpdateMapLeft(int8 x, int8 y, int16 mp, int8 stride, int16 value, int16* leftMps, int16* rightMps, int16* upMps, int16* downMps, BoardField* board)
+    template<coord Stride>
+    static void UpdateMapLeft(coord x, coord y, mpos mp, coord width, mpos value, CellArray<mpos> leftMps, CellArray<mpos> rightMps, CellArray<mpos> upMps, CellArray<mpos> downMps, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (x >= 0)
         {
             rightMps[mp] = value;
@@ -1177,9 +2772,9 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return UpdateMapDown(x, y + 1, mp + stride, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapDown<Stride>(x, y + 1, mp + stride, stride, value, leftMps, rightMps, upMps, downMps, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return UpdateMapUp(x, y - 1, mp - stride, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapUp<Stride>(x, y - 1, mp - stride, stride, value, leftMps, rightMps, upMps, downMps, board);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1189,8 +2784,11 @@ private:
         }
     }
 
-    static void UpdateMapRight(int8 x, int8 y, int16 mp, int8 stride, int16 value, int16* leftMps, int16* rightMps, int16* upMps, int16* downMps, BoardField* board)
+    template<coord Stride>
+    static void UpdateMapRight(coord x, coord y, mpos mp, coord width, mpos value, CellArray<mpos> leftMps, CellArray<mpos> rightMps, CellArray<mpos> upMps, CellArray<mpos> downMps, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (x < stride)
         {
             leftMps[mp] = value;
@@ -1199,9 +2797,9 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return UpdateMapUp(x, y - 1, mp - stride, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapUp<Stride>(x, y - 1, mp - stride, stride, value, leftMps, rightMps, upMps, downMps, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return UpdateMapDown(x, y + 1, mp + stride, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapDown<Stride>(x, y + 1, mp + stride, stride, value, leftMps, rightMps, upMps, downMps, board);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1211,8 +2809,11 @@ private:
         }
     }
 
-    static void UpdateMapUp(int8 x, int8 y, int16 mp, int8 stride, int16 value, int16* leftMps, int16* rightMps, int16* upMps, int16* downMps, BoardField* board)
+    template<coord Stride>
+    static void UpdateMapUp(coord x, coord y, mpos mp, coord width, mpos value, CellArray<mpos> leftMps, CellArray<mpos> rightMps, CellArray<mpos> upMps, CellArray<mpos> downMps, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (y >= 0)
         {
             downMps[mp] = value;
@@ -1221,9 +2822,9 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return UpdateMapRight(x + 1, y, mp + 1, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapRight<Stride>(x + 1, y, mp + 1, stride, value, leftMps, rightMps, upMps, downMps, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return UpdateMapLeft(x - 1, y, mp - 1, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapLeft<Stride>(x - 1, y, mp - 1, stride, value, leftMps, rightMps, upMps, downMps, board);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1233,9 +2834,11 @@ private:
         }
     }
 
-    static void UpdateMapDown(int8 x, int8 y, int16 mp, int8 stride, int16 value, int16* leftMps, int16* rightMps, int16* upMps, int16* downMps, BoardField* board)
+    template<coord Stride>
+    static void UpdateMapDown(coord x, coord y, mpos mp, coord width, mpos value, CellArray<mpos> leftMps, CellArray<mpos> rightMps, CellArray<mpos> upMps, CellArray<mpos> downMps, CellArray<BoardField> board)
     {
-        int16 mpMax = boardSize;
+        coord stride = RowStride<Stride>(width);
+        mpos mpMax = boardSize;
 
         while (mp < mpMax)
         {
@@ -1245,9 +2848,9 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return UpdateMapLeft(x - 1, y, mp, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapLeft<Stride>(x - 1, y, mp - 1, stride, value, leftMps, rightMps, upMps, downMps, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return UpdateMapRight(x + 1, y, mp, stride, value, leftMps, rightMps, upMps, downMps, board);
+                return UpdateMapRight<Stride>(x + 1, y, mp + 1, stride, value, leftMps, rightMps, upMps, downMps, board);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1257,8 +2860,10 @@ private:
         }
     }
 
-    static Hit AddColorLeft(int8 x, int8 y, int16 mp, int8 stride, Color color, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit AddColorLeft(coord x, coord y, mpos mp, coord width, Color color, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
         Light direction = Light::Empty;
 
         if ((color & Color::Blue) == Color::Blue)
@@ -1278,13 +2883,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return AddColorDown(x, y + 1, mp + stride, stride, color, lightMap, board);
+                return AddColorDown<Stride>(x, y + 1, mp + stride, stride, color, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return AddColorUp(x, y - 1, mp - stride, stride, color, lightMap, board);
+                return AddColorUp<Stride>(x, y - 1, mp - stride, stride, color, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(newLight & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, newLight);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1295,8 +2900,10 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit AddColorRight(int8 x, int8 y, int16 mp, int8 stride, Color color, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit AddColorRight(coord x, coord y, mpos mp, coord width, Color color, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
         Light direction = Light::Empty;
 
         if ((color & Color::Blue) == Color::Blue)
@@ -1316,13 +2923,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return AddColorUp(x, y - 1, mp - stride, stride, color, lightMap, board);
+                return AddColorUp<Stride>(x, y - 1, mp - stride, stride, color, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return AddColorDown(x, y + 1, mp + stride, stride, color, lightMap, board);
+                return AddColorDown<Stride>(x, y + 1, mp + stride, stride, color, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(newLight & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, newLight);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1333,8 +2940,10 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit AddColorUp(int8 x, int8 y, int16 mp, int8 stride, Color color, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit AddColorUp(coord x, coord y, mpos mp, coord width, Color color, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
         Light direction = Light::Empty;
 
         if ((color & Color::Blue) == Color::Blue)
@@ -1354,13 +2963,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return AddColorRight(x + 1, y, mp + 1, stride, color, lightMap, board);
+                return AddColorRight<Stride>(x + 1, y, mp + 1, stride, color, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return AddColorLeft(x - 1, y, mp - 1, stride, color, lightMap, board);
+                return AddColorLeft<Stride>(x - 1, y, mp - 1, stride, color, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(newLight & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, newLight);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1371,9 +2980,11 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit AddColorDown(int8 x, int8 y, int16 mp, int8 stride, Color color, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit AddColorDown(coord x, coord y, mpos mp, coord width, Color color, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
-        int16 mpMax = boardSize;
+        coord stride = RowStride<Stride>(width);
+        mpos mpMax = boardSize;
         Light direction = Light::Empty;
 
         if ((color & Color::Blue) == Color::Blue)
@@ -1393,13 +3004,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return AddColorLeft(x - 1, y, mp - 1, stride, color, lightMap, board);
+                return AddColorLeft<Stride>(x - 1, y, mp - 1, stride, color, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return AddColorRight(x + 1, y, mp + 1, stride, color, lightMap, board);
+                return AddColorRight<Stride>(x + 1, y, mp + 1, stride, color, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(newLight & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, newLight);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1410,8 +3021,11 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit ClearColorLeft(int8 x, int8 y, int16 mp, int8 stride, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit ClearColorLeft(coord x, coord y, mpos mp, coord width, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (x >= 0)
         {
             Light originalLight = lightMap[mp];
@@ -1435,13 +3049,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return ClearColorDown(x, y + 1, mp + stride, stride, lightMap, board);
+                return ClearColorDown<Stride>(x, y + 1, mp + stride, stride, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return ClearColorUp(x, y - 1, mp - stride, stride, lightMap, board);
+                return ClearColorUp<Stride>(x, y - 1, mp - stride, stride, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(light & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, light);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1452,8 +3066,11 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit ClearColorRight(int8 x, int8 y, int16 mp, int8 stride, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit ClearColorRight(coord x, coord y, mpos mp, coord width, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (x < stride)
         {
             Light originalLight = lightMap[mp];
@@ -1477,13 +3094,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return ClearColorUp(x, y - 1, mp - stride, stride, lightMap, board);
+                return ClearColorUp<Stride>(x, y - 1, mp - stride, stride, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return ClearColorDown(x, y + 1, mp + stride, stride, lightMap, board);
+                return ClearColorDown<Stride>(x, y + 1, mp + stride, stride, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(light & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, light);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1494,8 +3111,11 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit ClearColorUp(int8 x, int8 y, int16 mp, int8 stride, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit ClearColorUp(coord x, coord y, mpos mp, coord width, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (y >= 0)
         {
             Light originalLight = lightMap[mp];
@@ -1519,13 +3139,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return ClearColorRight(x + 1, y, mp + 1, stride, lightMap, board);
+                return ClearColorRight<Stride>(x + 1, y, mp + 1, stride, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return ClearColorLeft(x - 1, y, mp - 1, stride, lightMap, board);
+                return ClearColorLeft<Stride>(x - 1, y, mp - 1, stride, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(light & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, light);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1536,9 +3156,11 @@ private:
         return Hit(x, y, mp);
     }
 
-    static Hit ClearColorDown(int8 x, int8 y, int16 mp, int8 stride, Light* lightMap, BoardField* board)
+    template<coord Stride>
+    static Hit ClearColorDown(coord x, coord y, mpos mp, coord width, CellArray<Light> lightMap, CellArray<BoardField> board)
     {
-        int16 mpMax = boardSize;
+        coord stride = RowStride<Stride>(width);
+        mpos mpMax = boardSize;
 
         while (mp < mpMax)
         {
@@ -1563,13 +3185,13 @@ private:
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return ClearColorLeft(x - 1, y, mp - 1, stride, lightMap, board);
+                return ClearColorLeft<Stride>(x - 1, y, mp - 1, stride, lightMap, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return ClearColorRight(x + 1, y, mp + 1, stride, lightMap, board);
+                return ClearColorRight<Stride>(x + 1, y, mp + 1, stride, lightMap, board);
 
             // If we hit crystal, update score
             if ((field & BoardField::Crystal) != BoardField::Empty)
-                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), (Color)(originalLight & Light::ColorMask), (Color)(light & Light::ColorMask));
+                return Hit(x, y, mp, (Color)(field & BoardField::ColorMask), originalLight, light);
 
             // Stop if we hit an object
             if ((field & BoardField::ObjectMask) != BoardField::Empty)
@@ -1580,118 +3202,111 @@ private:
         return Hit(x, y, mp);
     }
 
-    static void InvalidatePreMovesLeft(int8 x, int8 y, int16 mp, int8 stride, PrecalculatedMoves* moves, BoardField* board, bool invalidateCrystals = true)
+    static void InvalidatePreMove(mpos mp, PrecalculatedMoves* moves, mpos* dirtyCells, mpos& dirtyCellsCount)
     {
-        while (x >= 0)
+        // Cells that are already invalid are already queued for recalculation
+        if (moves[mp].movesCount >= 0)
         {
             moves[mp].movesCount = -1;
+            dirtyCells[dirtyCellsCount++] = mp;
+        }
+    }
+
+    template<coord Stride>
+    static void InvalidatePreMovesLeft(coord x, coord y, mpos mp, coord width, PrecalculatedMoves* moves, mpos* dirtyCells, mpos& dirtyCellsCount, CellArray<BoardField> board)
+    {
+        coord stride = RowStride<Stride>(width);
+
+        while (x >= 0)
+        {
+            InvalidatePreMove(mp, moves, dirtyCells, dirtyCellsCount);
 
             // If we hit the mirror, we need to continue our search
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return InvalidatePreMovesDown(x, y + 1, mp + stride, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesDown<Stride>(x, y + 1, mp + stride, stride, moves, dirtyCells, dirtyCellsCount, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return InvalidatePreMovesUp(x, y - 1, mp - stride, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesUp<Stride>(x, y - 1, mp - stride, stride, moves, dirtyCells, dirtyCellsCount, board);
 
-            // If we hit crystal, we need to invalidate all of its directions
-            if (invalidateCrystals && (field & BoardField::Crystal) != BoardField::Empty)
-            {
-                InvalidatePreMovesDown(x, y + 1, mp + stride, stride, moves, board, false);
-                InvalidatePreMovesUp(x, y - 1, mp - stride, stride, moves, board, false);
-                invalidateCrystals = false;
-            }
-            // Stop if we hit an object
-            else if ((field & BoardField::ObjectMask) != BoardField::Empty)
+            // Stop if we hit an object (crystal's other directions are invalidated when its light changes)
+            if ((field & BoardField::ObjectMask) != BoardField::Empty)
                 break;
             x--;
             mp--;
         }
     }
 
-    static void InvalidatePreMovesRight(int8 x, int8 y, int16 mp, int8 stride, PrecalculatedMoves* moves, BoardField* board, bool invalidateCrystals = true)
+    template<coord Stride>
+    static void InvalidatePreMovesRight(coord x, coord y, mpos mp, coord width, PrecalculatedMoves* moves, mpos* dirtyCells, mpos& dirtyCellsCount, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (x < stride)
         {
-            moves[mp].movesCount = -1;
+            InvalidatePreMove(mp, moves, dirtyCells, dirtyCellsCount);
 
             // If we hit the mirror, we need to continue our search
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return InvalidatePreMovesUp(x, y - 1, mp - stride, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesUp<Stride>(x, y - 1, mp - stride, stride, moves, dirtyCells, dirtyCellsCount, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return InvalidatePreMovesDown(x, y + 1, mp + stride, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesDown<Stride>(x, y + 1, mp + stride, stride, moves, dirtyCells, dirtyCellsCount, board);
 
-            // If we hit crystal, we need to invalidate all of its directions
-            if (invalidateCrystals && (field & BoardField::Crystal) != BoardField::Empty)
-            {
-                InvalidatePreMovesDown(x, y + 1, mp + stride, stride, moves, board, false);
-                InvalidatePreMovesUp(x, y - 1, mp - stride, stride, moves, board, false);
-                invalidateCrystals = false;
-            }
-            // Stop if we hit an object
-            else if ((field & BoardField::ObjectMask) != BoardField::Empty)
+            // Stop if we hit an object (crystal's other directions are invalidated when its light changes)
+            if ((field & BoardField::ObjectMask) != BoardField::Empty)
                 break;
             x++;
             mp++;
         }
     }
 
-    static void InvalidatePreMovesUp(int8 x, int8 y, int16 mp, int8 stride, PrecalculatedMoves* moves, BoardField* board, bool invalidateCrystals = true)
+    template<coord Stride>
+    static void InvalidatePreMovesUp(coord x, coord y, mpos mp, coord width, PrecalculatedMoves* moves, mpos* dirtyCells, mpos& dirtyCellsCount, CellArray<BoardField> board)
     {
+        coord stride = RowStride<Stride>(width);
+
         while (y >= 0)
         {
-            moves[mp].movesCount = -1;
+            InvalidatePreMove(mp, moves, dirtyCells, dirtyCellsCount);
 
             // If we hit the mirror, we need to continue our search
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return InvalidatePreMovesRight(x + 1, y, mp + 1, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesRight<Stride>(x + 1, y, mp + 1, stride, moves, dirtyCells, dirtyCellsCount, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return InvalidatePreMovesLeft(x - 1, y, mp - 1, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesLeft<Stride>(x - 1, y, mp - 1, stride, moves, dirtyCells, dirtyCellsCount, board);
 
-            // If we hit crystal, we need to invalidate all of its directions
-            if (invalidateCrystals && (field & BoardField::Crystal) != BoardField::Empty)
-            {
-                InvalidatePreMovesLeft(x - 1, y, mp - 1, stride, moves, board, false);
-                InvalidatePreMovesRight(x + 1, y, mp + 1, stride, moves, board, false);
-                invalidateCrystals = false;
-            }
-            // Stop if we hit an object
-            else if ((field & BoardField::ObjectMask) != BoardField::Empty)
+            // Stop if we hit an object (crystal's other directions are invalidated when its light changes)
+            if ((field & BoardField::ObjectMask) != BoardField::Empty)
                 break;
             y--;
             mp -= stride;
         }
     }
 
-    static void InvalidatePreMovesDown(int8 x, int8 y, int16 mp, int8 stride, PrecalculatedMoves* moves, BoardField* board, bool invalidateCrystals = true)
+    template<coord Stride>
+    static void InvalidatePreMovesDown(coord x, coord y, mpos mp, coord width, PrecalculatedMoves* moves, mpos* dirtyCells, mpos& dirtyCellsCount, CellArray<BoardField> board)
     {
-        int16 mpMax = boardSize;
+        coord stride = RowStride<Stride>(width);
+        mpos mpMax = boardSize;
 
         while (mp < mpMax)
         {
-            moves[mp].movesCount = -1;
+            InvalidatePreMove(mp, moves, dirtyCells, dirtyCellsCount);
 
             // If we hit the mirror, we need to continue our search
             BoardField field = board[mp];
 
             if ((field & BoardField::MirrorSlash) != BoardField::Empty)
-                return InvalidatePreMovesLeft(x - 1, y, mp - 1, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesLeft<Stride>(x - 1, y, mp - 1, stride, moves, dirtyCells, dirtyCellsCount, board);
             if ((field & BoardField::MirrorBackSlash) != BoardField::Empty)
-                return InvalidatePreMovesRight(x + 1, y, mp + 1, stride, moves, board, invalidateCrystals);
+                return InvalidatePreMovesRight<Stride>(x + 1, y, mp + 1, stride, moves, dirtyCells, dirtyCellsCount, board);
 
-            // If we hit crystal, we need to invalidate all of its directions
-            if (invalidateCrystals && (field & BoardField::Crystal) != BoardField::Empty)
-            {
-                InvalidatePreMovesLeft(x - 1, y, mp - 1, stride, moves, board, false);
-                InvalidatePreMovesRight(x + 1, y, mp + 1, stride, moves, board, false);
-                invalidateCrystals = false;
-            }
-            // Stop if we hit an object
-            else if ((field & BoardField::ObjectMask) != BoardField::Empty)
+            // Stop if we hit an object (crystal's other directions are invalidated when its light changes)
+            if ((field & BoardField::ObjectMask) != BoardField::Empty)
                 break;
             y++;
             mp += stride;
@@ -1751,7 +3366,10 @@ private:
     }
 };
 
-int16 State::boardSize = -1;
+mpos State::boardSize = -1;
+int State::crystalsCount = 0;
+vector<BoardField> State::usefulMoves;
+const State::CrystalScoreDiffs State::crystalScoreDiffs;
 
 Move::Move(State* state, Lantern lantern, int cost)
     : state(state)
@@ -1762,6 +3380,16 @@ Move::Move(State* state, Lantern lantern, int cost)
     state->GetLanternScore(lantern, cost, score, potentialScore);
 }
 
+Move::Move(State* state, Lantern lantern, int score, int potentialScore)
+    : state(state)
+    , score(score)
+    , potentialScore(potentialScore)
+    , hash(state->hash ^ lantern.GetHash())
+    , lantern(lantern)
+    , type(MoveType::Lantern)
+{
+}
+
 Move::Move(State* state, Obstacle obstacle, int cost)
     : state(state)
     , obstacle(obstacle)
@@ -1780,6 +3408,17 @@ Move::Move(State* state, Mirror mirror, int cost)
     state->GetMirrorScore(mirror, cost, score, potentialScore);
 }
 
+Move::Move(State* state, Lantern first, Lantern second, int score, int potentialScore)
+    : state(state)
+    , score(score)
+    , potentialScore(potentialScore)
+    , hash(state->hash ^ first.GetHash() ^ second.GetHash())
+    , type(MoveType::LanternPair)
+{
+    lanterns[0] = first;
+    lanterns[1] = second;
+}
+
 void Move::ApplyToMe(int costLantern, int costObstacle, int costMirror)
 {
     switch (type)
@@ -1793,6 +3432,10 @@ void Move::ApplyToMe(int costLantern, int costObstacle, int costMirror)
     case MoveType::Mirror:
         state->PutMirror(mirror, costMirror);
         break;
+    case MoveType::LanternPair:
+        state->PutLantern(lanterns[0], costLantern);
+        state->PutLantern(lanterns[1], costLantern);
+        break;
     }
 }
 
@@ -1811,6 +3454,10 @@ State Move::Apply(int costLantern, int costObstacle, int costMirror) const
         case MoveType::Mirror:
             result.PutMirror(mirror, costMirror);
             break;
+        case MoveType::LanternPair:
+            result.PutLantern(lanterns[0], costLantern);
+            result.PutLantern(lanterns[1], costLantern);
+            break;
     }
 
     return result;
@@ -1824,345 +3471,2005 @@ bool Move::Same(const Move& other) const
         return false;
     if (potentialScore + state->potentialScore != other.potentialScore + other.state->potentialScore)
         return false;
-    size_t mirrorsCount = state->mirrors.size() + (type == MoveType::Mirror ? 1 : 0);
-    size_t otherMirrorsCount = other.state->mirrors.size() + (other.type == MoveType::Mirror ? 1 : 0);
-    if (mirrorsCount != otherMirrorsCount)
+    if (state->mirrorsCount + (type == MoveType::Mirror ? 1 : 0) != other.state->mirrorsCount + (other.type == MoveType::Mirror ? 1 : 0))
         return false;
-    size_t obstaclesCount = state->obstacles.size() + (type == MoveType::Obstacle ? 1 : 0);
-    size_t otherObstaclesCount = other.state->obstacles.size() + (other.type == MoveType::Obstacle ? 1 : 0);
-    if (obstaclesCount != otherObstaclesCount)
+    if (state->obstaclesCount + (type == MoveType::Obstacle ? 1 : 0) != other.state->obstaclesCount + (other.type == MoveType::Obstacle ? 1 : 0))
         return false;
-    size_t lanternsCount = state->lanterns.size() + (type == MoveType::Lantern ? 1 : 0);
-    size_t otherLanternsCount = other.state->lanterns.size() + (other.type == MoveType::Lantern ? 1 : 0);
-    if (lanternsCount != otherLanternsCount)
+    if (state->lanternsCount + (type == MoveType::Lantern ? 1 : type == MoveType::LanternPair ? 2 : 0) != other.state->lanternsCount + (other.type == MoveType::Lantern ? 1 : other.type == MoveType::LanternPair ? 2 : 0))
         return false;
-    for (auto& o : state->obstacles)
+    for (const ItemNode* node = state->items; node != nullptr; node = node->parent)
     {
-        int16 mp = o.position.y * state->width + o.position.x;
+        Position position = node->type == MoveType::Lantern ? node->lantern.position : node->type == MoveType::Obstacle ? node->obstacle.position : node->mirror.position;
+        mpos mp = position.y * state->width + position.x;
 
-        if (other.state->board[mp] != state->board[mp])
-        {
-            if (other.type == MoveType::Obstacle)
-                if (o.position == other.obstacle.position)
-                    continue;
+        if (other.state->board[mp] != state->board[mp] && !other.Places(*node))
             return false;
-        }
     }
     if (type == MoveType::Obstacle && other.state->board[obstacle.position.y * state->width + obstacle.position.x] != BoardField::Obstacle)
         return false;
-    for (auto& m : state->mirrors)
-    {
-        int16 mp = m.position.y * state->width + m.position.x;
-
-        if (other.state->board[mp] != state->board[mp])
-        {
-            if (other.type == MoveType::Mirror)
-                if (m.position == other.mirror.position && m.slash == other.mirror.slash)
-                    continue;
-            return false;
-        }
-    }
     if (type == MoveType::Mirror && other.state->board[mirror.position.y * state->width + mirror.position.x] != (mirror.slash ? BoardField::MirrorSlash : BoardField::MirrorBackSlash))
         return false;
-    for (auto& l : state->lanterns)
-    {
-        int16 mp = l.position.y * state->width + l.position.x;
-
-        if (other.state->board[mp] != state->board[mp])
-        {
-            if (other.type == MoveType::Lantern)
-                if (l.position == other.lantern.position && l.color == other.lantern.color)
-                    continue;
-            return false;
-        }
-    }
     if (type == MoveType::Lantern && other.state->board[lantern.position.y * state->width + lantern.position.x] != (BoardField::Lantern | (BoardField)lantern.color))
         return false;
+    if (type == MoveType::LanternPair)
+        for (const Lantern& l : lanterns)
+            if (other.state->board[l.position.y * state->width + l.position.x] != (BoardField::Lantern | (BoardField)l.color))
+                return false;
     return true;
 }
 
-class CrystalLighting
+// Checks if this move places given item
+bool Move::Places(const ItemNode& item) const
 {
-private:
-    double stopwatchStart;
-
-public:
-    vector<string> placeItems(vector<string> targetBoard, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    switch (item.type)
     {
-        // Start stopwatch
-        stopwatchStart = getTime();
-
-        // Parse input data
-        int height = (int)targetBoard.size();
-        int width = (int)targetBoard[0].size();
-        State inputState(width, height);
+        case MoveType::Lantern:
+            if (type == MoveType::Lantern)
+                return item.lantern.position == lantern.position && item.lantern.color == lantern.color;
+            if (type == MoveType::LanternPair)
+                return (item.lantern.position == lanterns[0].position && item.lantern.color == lanterns[0].color)
+                    || (item.lantern.position == lanterns[1].position && item.lantern.color == lanterns[1].color);
+            return false;
+        case MoveType::Obstacle:
+            return type == MoveType::Obstacle && item.obstacle.position == obstacle.position;
+        case MoveType::Mirror:
+            return type == MoveType::Mirror && item.mirror.position == mirror.position && item.mirror.slash == mirror.slash;
+        default:
+            return false;
+    }
+}
 
-        for (int y = 0; y < height; y++)
-            for (int x = 0; x < width; x++)
-            {
-                BoardField field;
+// Move generator policies: how candidate moves of a state are produced
+struct PrecalculatedMoveGenerator
+{
+    template<class Ranking>
+    static void GetMoves(State& state, vector<Move>& moves, size_t maxMoves, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        state.GetTopMoves<Ranking>(moves, maxMoves, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+    }
+};
 
-                switch (targetBoard[y][x])
-                {
-                case '.':
-                default:
-                    field = BoardField::Empty;
-                    break;
-                case 'X':
-                    field = BoardField::Obstacle;
-                    break;
-                case '1':
-                case '2':
-                case '3':
-                case '4':
-                case '5':
-                case '6':
-                    field = BoardField::Crystal | (BoardField)(targetBoard[y][x] - '0');
-                    break;
-                }
-                inputState.Board(y, x) = field;
-            }
-        inputState.UpdateFromBoard();
+struct FullScanMoveGenerator
+{
+    template<class Ranking>
+    static void GetMoves(State& state, vector<Move>& moves, size_t /*maxMoves*/, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        state.GetAllMoves(moves, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+    }
+};
 
-        maxMirrors = 0; // TODO:
-        // Do place items on the board
-        State solution = inputState;
+#ifdef USE_SLOW_ALGORITHM
+typedef FullScanMoveGenerator DefaultMoveGenerator;
+#else
+typedef PrecalculatedMoveGenerator DefaultMoveGenerator;
+#endif
 
-        for (maxRayWidth = 1; !TimeExceeded(); maxRayWidth *= 5)
-        {
-            State s = Solve(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+#if defined(USE_PROCESS_SHARDS) && !defined(WIN32)
 
-            if (s.score > solution.score)
-                solution = s;
-        }
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-        // Return result
-        vector<string> result;
+// Worker processes calculating moves of beam states. Buffers of states are allocated in memory shared with
+// the workers, so a worker updates precalculated moves of its shard of states in place; only fields kept
+// outside the buffer and top moves are passed in a second shared block. Workers are forked from the solver,
+// so they have the board it solves. Shard of a crashed worker is calculated by the coordinator and the
+// worker is not used again.
+class ProcessShards
+{
+public:
+    typedef function<void(State&, vector<Move>&, size_t)> MovesFunction;
 
-        for (auto& obstacle : solution.obstacles)
-        {
-            stringstream ss;
-            ss << (int)obstacle.position.y << " " << (int)obstacle.position.x << " X";
-            result.push_back(ss.str());
-        }
-        for (auto& mirror : solution.mirrors)
+    ProcessShards(const State& inputState, int workersCount, MovesFunction getMoves)
+        : getMoves(getMoves)
+        , width(inputState.width)
+        , height(inputState.height)
+        , results(nullptr)
+    {
+        if (SharedStates() == nullptr)
+            return;
+        results = (char*)mmap(nullptr, PROCESS_SHARDS_RESULTS_MEMORY, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (results == MAP_FAILED)
         {
-            stringstream ss;
-            ss << (int)mirror.position.y << " " << (int)mirror.position.x << " " << (mirror.slash ? '/' : '\\');
-            result.push_back(ss.str());
+            results = nullptr;
+            return;
         }
-        for (auto& lantern : solution.lanterns)
+        cout.flush();
+        cerr.flush();
+        for (int i = 0; i < workersCount; i++)
         {
-            stringstream ss;
-            ss << (int)lantern.position.y << " " << (int)lantern.position.x << " " << (int)lantern.color;
-            result.push_back(ss.str());
+            int channels[2];
+
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, channels) != 0)
+                break;
+
+            pid_t pid = fork();
+
+            if (pid == 0)
+            {
+                close(channels[0]);
+                for (auto& worker : workers)
+                    close(worker.channel);
+                WorkerLoop(channels[1]);
+            }
+            close(channels[1]);
+            if (pid < 0)
+            {
+                close(channels[0]);
+                break;
+            }
+            workers.push_back(Worker{ pid, channels[0] });
         }
-        return result;
     }
 
-private:
-    bool TimeExceeded()
+    ~ProcessShards()
     {
-        return ElapsedSeconds() >= MAX_EXECUTION_TIME;
+        for (auto& worker : workers)
+            StopWorker(worker);
+        if (results != nullptr)
+            munmap(results, PROCESS_SHARDS_RESULTS_MEMORY);
     }
 
-    double ElapsedSeconds()
+    // Maps memory for state buffers once for the whole process, as pooled buffers stay in it
+    static char* SharedStates()
     {
-        return getTime() - stopwatchStart;
+        static char* memory = MapSharedStates();
+
+        return memory;
     }
 
-    State Solve(State inputState, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    int WorkersCount() const
     {
-        vector<int> refCounts;
-        vector<Move> moves, currentMoves;
-        vector<State> previousStates;
-        vector<State> newStates;
-        State bestSolution = inputState;
-        int steps = 0;
+        int count = 0;
 
-        previousStates.push_back(inputState);
-        while (!TimeExceeded() && !previousStates.empty())
-        {
-#if LOCAL
-            //cerr << steps << ". " << bestSolution.score << " " << ElapsedSeconds() << "s " << bestSolution.lanterns.size() << " " << bestSolution.mirrors.size() << " " << bestSolution.obstacles.size() << endl;
-#endif
-            steps++;
-            for (auto& previousState : previousStates)
-            {
-                if (TimeExceeded())
-                    break;
+        for (auto& worker : workers)
+            count += worker.pid > 0;
+        return count;
+    }
 
-#ifdef USE_SLOW_ALGORITHM
-                int16 mp = 0;
-                for (int8 y = 0; y < inputState.height; y++)
-                {
-                    if (TimeExceeded())
-                        break;
-                    for (int8 x = 0; x < inputState.width; x++, mp++)
-                        if ((previousState.board[mp] & BoardField::ObjectMask) == BoardField::Empty)
-                        {
-                            if ((previousState.lightMap[mp] & Light::ColorMask) == Light::Empty)
-                            {
-                                // See if any crystal can be hit from this position in the map
-                                Color color = (Color)(previousState.crystalsLightMap[mp] & Light::ColorMask);
-
-                                if (color == Color::Empty)
-                                    continue;
-
-                                Lantern lantern;
-                                lantern.position.x = x;
-                                lantern.position.y = y;
-
-                                // Try putting lantern
-                                if ((color & Color::Blue) != Color::Empty)
-                                {
-                                    lantern.color = Color::Blue;
-                                    AddMove(Move(&previousState, lantern, costLantern), moves);
-                                }
-                                if ((color & Color::Yellow) != Color::Empty)
-                                {
-                                    lantern.color = Color::Yellow;
-                                    AddMove(Move(&previousState, lantern, costLantern), moves);
-                                }
-                                if ((color & Color::Red) != Color::Empty)
-                                {
-                                    lantern.color = Color::Red;
-                                    AddMove(Move(&previousState, lantern, costLantern), moves);
-                                }
-                            }
-                            else
-                            {
-                                // Try to put Obstacle
-                                if ((int)previousState.obstacles.size() < maxObstacles)
-                                {
-                                    Obstacle obstacle;
-                                    obstacle.position.x = x;
-                                    obstacle.position.y = y;
-                                    AddMove(Move(&previousState, obstacle, costObstacle), moves);
-                                }
-
-                                // Try to put slash Mirror '/'
-                                if ((int)previousState.mirrors.size() >= maxMirrors)
-                                    continue;
-                                Mirror mirror;
-                                mirror.position.x = x;
-                                mirror.position.y = y;
-                                mirror.slash = true;
-
-                                if (previousState.IsPuttingMirrorSafe(mirror))
-                                    AddMove(Move(&previousState, mirror, costMirror), moves);
-
-                                // Try to put backslash Mirror '\'
-                                mirror.slash = false;
-                                if (previousState.IsPuttingMirrorSafe(mirror))
-                                    AddMove(Move(&previousState, mirror, costMirror), moves);
-                            }
-                        }
-                }
-#else
-                previousState.GetTopMoves(currentMoves, maxRayWidth, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
-                for (auto& move : currentMoves)
-                    AddMove(move, moves);
-#endif
-            }
+    // Calculates top moves of all states and passes them to addMove in the same order as a loop over states
+    // would. Returns false if nothing was calculated, because moves of one state don't fit shared memory.
+    bool GetMoves(vector<State>& states, size_t maxMoves, function<void(const Move&)> addMove)
+    {
+        size_t slotsCount = results != nullptr ? PROCESS_SHARDS_RESULTS_MEMORY / SlotSize(maxMoves) : 0;
 
-            // Check if we can reuse current state object instead of creating a copy
-            refCounts.clear();
-            refCounts.resize(previousStates.size(), 0);
-            for (auto& move : moves)
-                refCounts[move.state - previousStates.data()]++;
+        if (slotsCount == 0 || WorkersCount() == 0)
+            return false;
+        for (size_t first = 0; first < states.size(); first += slotsCount)
+            GetBatchMoves(states, first, std::min(states.size(), first + slotsCount), maxMoves, addMove);
+        return true;
+    }
 
-            // Convert moves to states
-            for (auto& move : moves)
-            {
-                int index = move.state - previousStates.data();
-                int& refCount = refCounts[index];
-                bool reuse = refCount == 1;
+private:
+    struct Worker
+    {
+        pid_t pid;
+        int channel;
+    };
 
-                if (reuse)
-                {
-                    move.ApplyToMe(costLantern, costObstacle, costMirror);
-                    newStates.emplace_back(std::move(*move.state));
-                }
-                else
-                    newStates.emplace_back(move.Apply(costLantern, costObstacle, costMirror));
-                refCount--;
-            }
+    struct Command
+    {
+        uint64_t first;
+        uint64_t last;
+        uint64_t maxMoves;
+    };
 
-            // Check if we found better solution
-            for (auto& state : newStates)
-                if (state.score > bestSolution.score)
-                    bestSolution = state;
+    // State fields not kept in its buffer, followed by top moves in a slot of results
+    struct ShardState
+    {
+        char* memoryBuffer;
+        int score;
+        int potentialScore;
+        int litCrystals;
+        int hash;
+        int lanternsCount;
+        int obstaclesCount;
+        int mirrorsCount;
+        mpos dirtyCellsCount;
+        int16 topCandidateBucket;
+        uint32_t movesCount;
+    };
 
-            // Store new states to previous states
-            previousStates.swap(newStates);
-            newStates.clear();
-            moves.clear();
-        }
+    MovesFunction getMoves;
+    coord width;
+    coord height;
+    char* results;
+    vector<Worker> workers;
 
-        cerr << steps << ". " << bestSolution.score << " " << ElapsedSeconds() << "s " << bestSolution.lanterns.size() << " " << bestSolution.mirrors.size() << " " << bestSolution.obstacles.size() << endl;
-        return bestSolution;
+    static char* MapSharedStates()
+    {
+        void* memory = mmap(nullptr, PROCESS_SHARDS_MEMORY, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (memory == MAP_FAILED)
+            return nullptr;
+        State::SetSharedMemory((char*)memory, PROCESS_SHARDS_MEMORY);
+        return (char*)memory;
     }
 
-    static size_t maxRayWidth;
+    // Pair moves can exceed maxMoves
+    static size_t SlotMoves(size_t maxMoves)
+    {
+        return maxMoves + PAIR_MOVES_FIRST_LANTERNS;
+    }
 
-    static bool MoveComparison(const Move& m1, const Move& m2)
+    static size_t SlotSize(size_t maxMoves)
     {
-#ifdef USE_POTENTIAL_SCORE
-        return m2.potentialScore + m2.state->potentialScore < m1.potentialScore + m1.state->potentialScore;
-#else
-        return m2.score + m2.state->score < m1.score + m1.state->score;
-#endif
+        return sizeof(ShardState) + sizeof(Move) * SlotMoves(maxMoves);
     }
 
-    void AddMove(const Move& move, vector<Move>& moves)
+    ShardState& Slot(size_t index, size_t maxMoves) const
     {
-        if (moves.size() < maxRayWidth)
+        return *(ShardState*)(results + SlotSize(maxMoves) * index);
+    }
+
+    void GetBatchMoves(vector<State>& states, size_t first, size_t last, size_t maxMoves, function<void(const Move&)>& addMove)
+    {
+        vector<size_t> shardEnds;
+        vector<bool> calculated(last - first, false);
+        vector<Move> moves;
+        size_t shardSize = (last - first + WorkersCount() - 1) / WorkersCount();
+        size_t next = first;
+
+        for (auto& worker : workers)
         {
-            if (!moves.empty())
-            {
-                auto it = lower_bound(moves.begin(), moves.end(), move, MoveComparison);
+            Command command{ next - first, std::min(last, next + shardSize) - first, maxMoves };
 
-#ifdef USE_POTENTIAL_SCORE
-                while (it != moves.end() && it->potentialScore + it->state->potentialScore == move.potentialScore + move.state->potentialScore)
-#else
-                while (it != moves.end() && it->score + it->state->score == move.score + move.state->score)
-#endif
-                {
-                    if (it->hash == move.hash && it->Same(move))
-                        return;
-                    it++;
-                }
-                moves.insert(it, move);
+            if (worker.pid <= 0 || command.first >= command.last)
+            {
+                shardEnds.push_back(next);
+                continue;
             }
-            else
-                moves.push_back(move);
+            for (size_t i = next; i < first + command.last; i++)
+            {
+                const State& state = states[i];
+                ShardState& slot = Slot(i - first, maxMoves);
+
+                // States with buffers allocated before shared memory are calculated here
+                slot.memoryBuffer = State::IsShared(state.memoryBuffer) ? state.memoryBuffer : nullptr;
+                slot.score = state.score;
+                slot.potentialScore = state.potentialScore;
+                slot.litCrystals = state.litCrystals;
+                slot.hash = state.hash;
+                slot.lanternsCount = state.lanternsCount;
+                slot.obstaclesCount = state.obstaclesCount;
+                slot.mirrorsCount = state.mirrorsCount;
+                slot.dirtyCellsCount = state.dirtyCellsCount;
+                slot.topCandidateBucket = state.topCandidateBucket;
+            }
+            if (!Send(worker.channel, &command, sizeof(command)))
+                FailWorker(worker);
+            next = first + command.last;
+            shardEnds.push_back(next);
         }
-        else
+
+        // Collect finished shards; states of failed ones and states with too many moves are calculated here
+        for (size_t w = 0, shardFirst = first; w < workers.size(); shardFirst = shardEnds[w++])
         {
-#ifdef USE_POTENTIAL_SCORE
-            if (moves[moves.size() - 1].potentialScore + moves[moves.size() - 1].state->potentialScore >= move.potentialScore + move.state->potentialScore)
-#else
-            if (moves[moves.size() - 1].score + moves[moves.size() - 1].state->score >= move.score + move.state->score)
-#endif
-                return;
+            char done;
+
+            if (workers[w].pid <= 0 || shardFirst == shardEnds[w])
+                continue;
+            if (!Receive(workers[w].channel, &done, sizeof(done)))
+            {
+                FailWorker(workers[w]);
+                continue;
+            }
+            for (size_t i = shardFirst; i < shardEnds[w]; i++)
+            {
+                ShardState& slot = Slot(i - first, maxMoves);
 
-            auto it = lower_bound(moves.begin(), moves.end(), move, MoveComparison);
+                calculated[i - first] = slot.memoryBuffer != nullptr;
+                states[i].dirtyCellsCount = slot.dirtyCellsCount;
+                states[i].topCandidateBucket = slot.topCandidateBucket;
+            }
+        }
 
-#ifdef USE_POTENTIAL_SCORE
-            while (it != moves.end() && it->potentialScore + it->state->potentialScore == move.potentialScore + move.state->potentialScore)
-#else
-            while (it != moves.end() && it->score + it->state->score == move.score + move.state->score)
-#endif
+        for (size_t i = first; i < last; i++)
+        {
+            if (calculated[i - first])
             {
-                if (it->hash == move.hash && it->Same(move))
-                    return;
-                it++;
+                ShardState& slot = Slot(i - first, maxMoves);
+
+                moves.resize(slot.movesCount);
+                memcpy(moves.data(), &slot + 1, sizeof(Move) * moves.size());
+            }
+            else
+                getMoves(states[i], moves, maxMoves);
+            for (auto& move : moves)
+            {
+                move.state = &states[i];
+                addMove(move);
             }
-            moves.insert(it, move);
-            moves.resize(maxRayWidth);
         }
     }
-};
 
-size_t CrystalLighting::maxRayWidth = 0;
+    [[noreturn]] void WorkerLoop(int channel)
+    {
+        State state;
+        vector<Move> moves;
+        Command command;
+
+        // Only the forking thread exists here
+        ThreadPool::Disabled() = true;
+        state.width = width;
+        state.height = height;
+        state.items = nullptr;
+        while (Receive(channel, &command, sizeof(command)))
+        {
+            char done = 1;
+
+            for (uint64_t i = command.first; i < command.last; i++)
+            {
+                ShardState& slot = Slot((size_t)i, (size_t)command.maxMoves);
+
+                if (slot.memoryBuffer == nullptr)
+                    continue;
+                state.AttachBuffer(slot.memoryBuffer);
+                state.score = slot.score;
+                state.potentialScore = slot.potentialScore;
+                state.litCrystals = slot.litCrystals;
+                state.hash = slot.hash;
+                state.lanternsCount = slot.lanternsCount;
+                state.obstaclesCount = slot.obstaclesCount;
+                state.mirrorsCount = slot.mirrorsCount;
+                state.dirtyCellsCount = slot.dirtyCellsCount;
+                state.topCandidateBucket = slot.topCandidateBucket;
+                getMoves(state, moves, (size_t)command.maxMoves);
+                slot.dirtyCellsCount = state.dirtyCellsCount;
+                slot.topCandidateBucket = state.topCandidateBucket;
+
+                // Generator not bound by maxMoves can return more moves than the slot holds, they are not cut but
+                // calculated again by the coordinator
+                if (moves.size() > SlotMoves((size_t)command.maxMoves))
+                {
+                    slot.memoryBuffer = nullptr;
+                    continue;
+                }
+                slot.movesCount = (uint32_t)moves.size();
+                memcpy(&slot + 1, moves.data(), sizeof(Move) * slot.movesCount);
+            }
+            if (!Send(channel, &done, sizeof(done)))
+                break;
+        }
+        // Buffers belong to the solver and so do destructors of everything else
+        state.memoryBuffer = nullptr;
+        _exit(0);
+    }
+
+    void FailWorker(Worker& worker)
+    {
+        cerr << "Shard worker " << worker.pid << " failed" << endl;
+        StopWorker(worker);
+    }
+
+    void StopWorker(Worker& worker)
+    {
+        if (worker.pid <= 0)
+            return;
+        close(worker.channel);
+        waitpid(worker.pid, nullptr, 0);
+        worker.pid = -1;
+    }
+
+    static bool Send(int channel, const void* data, size_t size)
+    {
+        for (size_t sent = 0; sent < size;)
+        {
+            ssize_t result = send(channel, (const char*)data + sent, size - sent, MSG_NOSIGNAL);
+
+            if (result <= 0)
+                return false;
+            sent += result;
+        }
+        return true;
+    }
+
+    static bool Receive(int channel, void* data, size_t size)
+    {
+        for (size_t received = 0; received < size;)
+        {
+            ssize_t result = recv(channel, (char*)data + received, size - received, 0);
+
+            if (result <= 0)
+                return false;
+            received += result;
+        }
+        return true;
+    }
+};
+
+#endif
+
+// Binary log of beam search for offline analysis. After the board record, every run writes its start, its
+// levels and its best state. Level record holds candidates offered to the beam, candidates dropped as
+// duplicates and the selected moves in beam order with their parent index in the previous level, rank and
+// resulting score. Records are written as they are, so the reader has to be built for the same platform.
+class SearchTrace
+{
+public:
+    enum class RecordType : uint8_t
+    {
+        Board = 1,
+        Run,
+        Level,
+        RunEnd
+    };
+
+    struct BoardRecord
+    {
+        uint32_t magic;
+        int32_t width;
+        int32_t height;
+        int32_t costLantern;
+        int32_t costMirror;
+        int32_t costObstacle;
+        int32_t maxMirrors;
+        int32_t maxObstacles;
+    };
+
+    struct RunRecord
+    {
+        int32_t startLevel; // Level the run continues from, 0 if it starts from the input state
+        float seconds;      // Time since placeItems started
+    };
+
+    struct LevelRecord
+    {
+        int32_t level;
+        float seconds;
+        uint32_t maxRayWidth;
+        uint32_t candidates;
+        uint32_t dedupHits;
+        uint32_t movesCount;
+    };
+
+    struct MoveRecord
+    {
+        uint32_t parent; // Index of the parent state in the previous level
+        int32_t rank;
+        int32_t score;   // Score of the resulting state
+        MoveType type;
+        int8 values[2];  // Lantern colors or mirror slash
+        int16 x[2];
+        int16 y[2];
+    };
+
+    struct RunEndRecord
+    {
+        int32_t bestLevel; // 0 if no state beat the input state
+        int32_t bestIndex;
+        int32_t bestScore;
+    };
+
+    static const uint32_t Magic = 0x54534C43; // "CLST"
+
+    SearchTrace(const string& fileName, double start, const State& inputState, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+        : out(fileName, ios::binary)
+        , start(start)
+    {
+        BoardRecord board = { Magic, inputState.width, inputState.height, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles };
+
+        Write(RecordType::Board, board);
+    }
+
+    void StartRun(int startLevel)
+    {
+        RunRecord run = { startLevel, (float)(getTime() - start) };
+
+        Write(RecordType::Run, run);
+    }
+
+    // Moves must be recorded before they are applied, as they refer to their parent states
+    template<class RankFunction>
+    void AddLevel(int level, size_t maxRayWidth, size_t candidates, size_t dedupHits, const vector<Move>& moves, const State* parents, RankFunction rank)
+    {
+        LevelRecord record = { level, (float)(getTime() - start), (uint32_t)maxRayWidth, (uint32_t)candidates, (uint32_t)dedupHits, (uint32_t)moves.size() };
+
+        records.resize(moves.size());
+        for (size_t i = 0; i < moves.size(); i++)
+        {
+            const Move& move = moves[i];
+            MoveRecord& moveRecord = records[i];
+
+            memset(&moveRecord, 0, sizeof(moveRecord));
+            moveRecord.parent = (uint32_t)(move.state - parents);
+            moveRecord.rank = rank(move);
+            moveRecord.score = move.score + move.state->score;
+            moveRecord.type = move.type;
+            switch (move.type)
+            {
+                case MoveType::Lantern:
+                    SetItem(moveRecord, 0, move.lantern.position, (int8)move.lantern.color);
+                    break;
+                case MoveType::Obstacle:
+                    SetItem(moveRecord, 0, move.obstacle.position, 0);
+                    break;
+                case MoveType::Mirror:
+                    SetItem(moveRecord, 0, move.mirror.position, (int8)move.mirror.slash);
+                    break;
+                case MoveType::LanternPair:
+                    SetItem(moveRecord, 0, move.lanterns[0].position, (int8)move.lanterns[0].color);
+                    SetItem(moveRecord, 1, move.lanterns[1].position, (int8)move.lanterns[1].color);
+                    break;
+            }
+        }
+        Write(RecordType::Level, record);
+        out.write((const char*)records.data(), sizeof(MoveRecord) * records.size());
+    }
+
+    void EndRun(int bestLevel, int bestIndex, int bestScore)
+    {
+        RunEndRecord runEnd = { bestLevel, bestIndex, bestScore };
+
+        Write(RecordType::RunEnd, runEnd);
+        out.flush();
+    }
+
+private:
+    ofstream out;
+    double start;
+    vector<MoveRecord> records;
+
+    template<class T>
+    void Write(RecordType type, const T& record)
+    {
+        out.put((char)type);
+        out.write((const char*)&record, sizeof(record));
+    }
+
+    static void SetItem(MoveRecord& record, int index, Position position, int8 value)
+    {
+        record.values[index] = value;
+        record.x[index] = position.x;
+        record.y[index] = position.y;
+    }
+};
+
+// Shared by a running search and threads watching it. Search reports its new best states and checks for
+// cancellation; watchers read the best solution and cancel. Only states better than the best one reported
+// are converted to items, and cancellation and best score are read without locking.
+class SearchProgress
+{
+public:
+    typedef function<void(int score, const vector<string>& items)> ImprovementCallback;
+
+    SearchProgress()
+        : cancelled(false)
+        , bestScore(numeric_limits<int>::min())
+    {
+    }
+
+    // Clears cancellation and the best solution before a new search
+    void Reset()
+    {
+        cancelled.store(false, memory_order_relaxed);
+        ClearBest();
+    }
+
+    void ClearBest()
+    {
+        lock_guard<mutex> lock(bestMutex);
+
+        bestItems.clear();
+        bestScore.store(numeric_limits<int>::min(), memory_order_release);
+    }
+
+    void Cancel()
+    {
+        cancelled.store(true, memory_order_relaxed);
+    }
+
+    bool Cancelled() const
+    {
+        return cancelled.load(memory_order_relaxed);
+    }
+
+    // Called on a search thread for every new best solution, so it must return quickly. Calls are serialized
+    // and their scores increase even with portfolio threads. The best solution is not locked during the call,
+    // so the callback can read the progress, but it must not set the callback.
+    void SetImprovementCallback(ImprovementCallback callback)
+    {
+        lock_guard<mutex> lock(callbackMutex);
+
+        improvementCallback = callback;
+    }
+
+    // Score of the best solution reported, numeric_limits<int>::min() if there is none yet
+    int GetBestScore() const
+    {
+        return bestScore.load(memory_order_acquire);
+    }
+
+    // Returns false if no solution was reported yet
+    bool GetBest(vector<string>& items, int& score) const
+    {
+        lock_guard<mutex> lock(bestMutex);
+
+        items = bestItems;
+        score = bestScore.load(memory_order_relaxed);
+        return score != numeric_limits<int>::min();
+    }
+
+    void Report(const State& state)
+    {
+        if (state.score <= bestScore.load(memory_order_relaxed))
+            return;
+
+        Report(state.score, state.GetResult());
+    }
+
+    // Reports solution which is already converted to items, e.g. one found in the solution cache
+    void Report(int score, const vector<string>& items)
+    {
+        {
+            lock_guard<mutex> lock(bestMutex);
+
+            // Other search thread could report better state meanwhile
+            if (score <= bestScore.load(memory_order_relaxed))
+                return;
+            bestItems = items;
+            bestScore.store(score, memory_order_release);
+        }
+
+        // Improvement overtaken by a better one reported by another thread meanwhile is not announced
+        lock_guard<mutex> lock(callbackMutex);
+
+        if (improvementCallback && score >= bestScore.load(memory_order_relaxed))
+            improvementCallback(score, items);
+    }
+
+private:
+    atomic<bool> cancelled;
+    atomic<int> bestScore;
+    mutable mutex bestMutex;
+    vector<string> bestItems;
+    mutex callbackMutex;
+    ImprovementCallback improvementCallback;
+};
+
+template<class Ranking, class MoveGenerator>
+class BeamSearch
+{
+public:
+    BeamSearch(double deadline, unsigned tieBreakSeed = 0)
+        : stopwatchStart(getTime())
+        , deadline(deadline)
+        , tieBreakSeed(tieBreakSeed)
+        , maxRayWidth(0)
+        , adaptiveWidth(false)
+        , levels(0)
+        , levelsPerCrystal(0)
+        , secondsPerState(0)
+        , runSolution(nullptr)
+        , resumeSteps(0)
+        , lastCheckpoint(0)
+        , processShardsCount(0)
+        , adaptiveTimeShare(ADAPTIVE_BEAM_TIME_SHARE)
+        , trace(nullptr)
+        , progress(nullptr)
+        , candidatesCount(0)
+        , dedupHits(0)
+#ifdef USE_DIVERSE_BEAM
+        , maxRegionShare(DIVERSE_BEAM_MAX_SHARE)
+#else
+        , maxRegionShare(0)
+#endif
+        , maxRegionMoves(0)
+        , regionsWidth(0)
+    {
+    }
+
+    State Run(const State& inputState, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        State solution = inputState;
+        bool resumed = false;
+
+        runSolution = &solution;
+        if (!checkpointFile.empty())
+        {
+            checkpointKey = GetCheckpointKey(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+            resumed = ReadCheckpoint(inputState, solution, costLantern, costMirror, costObstacle);
+        }
+
+#ifdef USE_ADAPTIVE_BEAM_WIDTH
+        // Pilot run with width 1 measures levels needed per crystal and time per state
+        if (!adaptiveWidth)
+        {
+            double pilotStart = getTime();
+
+            if (!resumed)
+                maxRayWidth = 1;
+
+            State s = Solve(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+            if (s.score > solution.score)
+                solution = s;
+            levelsPerCrystal = (double)levels / std::max(1, State::crystalsCount - inputState.litCrystals);
+            secondsPerState = (getTime() - pilotStart) / std::max(1, levels);
+        }
+
+        // Every following run plans its width for the time left
+        adaptiveWidth = true;
+        while (!TimeExceeded())
+        {
+            State s = Solve(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+            if (s.score > solution.score)
+                solution = s;
+        }
+#else
+        if (!resumed)
+            maxRayWidth = 1;
+        for (; !TimeExceeded(); maxRayWidth *= 5)
+        {
+            State s = Solve(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+            if (s.score > solution.score)
+                solution = s;
+        }
+#endif
+        runSolution = nullptr;
+        if (!checkpointFile.empty())
+            remove(checkpointFile.c_str());
+#if defined(USE_PROCESS_SHARDS) && !defined(WIN32)
+        processShards.reset();
+#endif
+        return solution;
+    }
+
+    void SetMaxRayWidth(size_t width)
+    {
+        maxRayWidth = width;
+    }
+
+    // Run writes its progress to the file and continues from it, if it holds an unfinished run of the same input
+    void SetCheckpointFile(const string& fileName)
+    {
+        checkpointFile = fileName;
+    }
+
+    void SetAdaptiveTimeShare(double share)
+    {
+        adaptiveTimeShare = share;
+    }
+
+    // Limits moves placing items in one board region to given multiple of its even share of the beam, 0 for no limit
+    void SetMaxRegionShare(double share)
+    {
+        maxRegionShare = share;
+    }
+
+    // Every run and level is written to the trace
+    void SetTrace(SearchTrace* trace)
+    {
+        this->trace = trace;
+    }
+
+    // Search stops when progress is cancelled and reports its new best states to it
+    void SetProgress(SearchProgress* progress)
+    {
+        this->progress = progress;
+    }
+
+    // Search on large boards calculates moves of wide levels in this many worker processes
+    void SetProcessShards(int workersCount)
+    {
+        processShardsCount = workersCount;
+    }
+
+    State Solve(State inputState, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        vector<int> refCounts;
+        vector<Move> moves, currentMoves;
+        vector<State> previousStates;
+        vector<State> newStates;
+        State bestSolution = inputState;
+        int steps = 0;
+        int bestLevel = 0, bestIndex = 0;
+        double levelStart = getTime();
+        size_t expandedStates = 0;
+
+#if defined(USE_PROCESS_SHARDS) && !defined(WIN32)
+        // Workers are started by the first run and kept until the search ends
+        if (processShards == nullptr && processShardsCount > 0 && inputState.width * inputState.height >= PROCESS_SHARDS_MIN_CELLS)
+            processShards.reset(new ProcessShards(inputState, processShardsCount, [=](State& state, vector<Move>& moves, size_t maxMoves)
+            {
+                MoveGenerator::template GetMoves<Ranking>(state, moves, maxMoves, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+            }));
+#endif
+        if (resumeBeam.empty())
+            previousStates.push_back(inputState);
+        else
+        {
+            // Continue the run read from the checkpoint
+            previousStates.swap(resumeBeam);
+            bestSolution = resumeSolution;
+            steps = resumeSteps;
+            resumeBeam.clear();
+        }
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::SetLevel(steps);
+#endif
+        if (maxRegionShare > 0)
+        {
+            regionsWidth = (inputState.width + DIVERSE_BEAM_REGION_SIZE - 1) / DIVERSE_BEAM_REGION_SIZE;
+            regionMoves.resize(regionsWidth * ((inputState.height + DIVERSE_BEAM_REGION_SIZE - 1) / DIVERSE_BEAM_REGION_SIZE));
+        }
+        if (trace != nullptr)
+            trace->StartRun(steps);
+        while (!TimeExceeded() && !previousStates.empty())
+        {
+            steps++;
+#ifdef USE_ALLOCATION_TRACKING
+            AllocationTracker::SetLevel(steps);
+#endif
+            if (adaptiveWidth)
+            {
+                ScheduleRayWidth(previousStates, getTime() - levelStart, expandedStates);
+                levelStart = getTime();
+                expandedStates = previousStates.size();
+            }
+            bool sharded = false;
+
+            if (maxRegionShare > 0)
+            {
+                fill(regionMoves.begin(), regionMoves.end(), 0);
+                maxRegionMoves = (size_t)(maxRegionShare * maxRayWidth / regionMoves.size()) + 1;
+            }
+#if defined(USE_PROCESS_SHARDS) && !defined(WIN32)
+            if (processShards != nullptr && previousStates.size() >= PROCESS_SHARDS_MIN_STATES)
+                sharded = processShards->GetMoves(previousStates, maxRayWidth, [&](const Move& move) { AddMove(move, moves); });
+#endif
+            for (size_t i = 0; i < previousStates.size() && !sharded; i++)
+            {
+                if (TimeExceeded())
+                    break;
+
+                MoveGenerator::template GetMoves<Ranking>(previousStates[i], currentMoves, maxRayWidth, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+                for (auto& move : currentMoves)
+                    AddMove(move, moves);
+            }
+            if (trace != nullptr)
+            {
+                trace->AddLevel(steps, maxRayWidth, candidatesCount, dedupHits, moves, previousStates.data(), Rank);
+                candidatesCount = 0;
+                dedupHits = 0;
+            }
+
+            // Check if we can reuse current state object instead of creating a copy
+            refCounts.clear();
+            refCounts.resize(previousStates.size(), 0);
+            for (auto& move : moves)
+                refCounts[move.state - previousStates.data()]++;
+
+            // Convert moves to states
+            for (auto& move : moves)
+            {
+                int index = move.state - previousStates.data();
+                int& refCount = refCounts[index];
+                bool reuse = refCount == 1;
+
+                if (reuse)
+                {
+                    move.ApplyToMe(costLantern, costObstacle, costMirror);
+                    newStates.emplace_back(std::move(*move.state));
+                }
+                else
+                    newStates.emplace_back(move.Apply(costLantern, costObstacle, costMirror));
+                refCount--;
+            }
+
+            // Check if we found better solution
+            for (size_t i = 0; i < newStates.size(); i++)
+                if (newStates[i].score > bestSolution.score)
+                {
+                    bestSolution = newStates[i];
+                    bestLevel = steps;
+                    bestIndex = (int)i;
+                }
+            if (progress != nullptr && bestLevel == steps)
+                progress->Report(bestSolution);
+
+            // Store new states to previous states
+            previousStates.swap(newStates);
+            newStates.clear();
+            moves.clear();
+            if (!checkpointFile.empty() && getTime() - lastCheckpoint >= CHECKPOINT_INTERVAL)
+                WriteCheckpoint(previousStates, bestSolution, steps);
+        }
+
+        levels = steps;
+        if (trace != nullptr)
+            trace->EndRun(bestLevel, bestIndex, bestSolution.score);
+        cerr << steps << ". " << bestSolution.score << " " << getTime() - stopwatchStart << "s " << bestSolution.lanternsCount << " " << bestSolution.mirrorsCount << " " << bestSolution.obstaclesCount << endl;
+        return bestSolution;
+    }
+
+private:
+    double stopwatchStart;
+    double deadline;
+    unsigned tieBreakSeed;
+    size_t maxRayWidth;
+    bool adaptiveWidth;
+    int levels;              // Levels of the last run
+    double levelsPerCrystal; // Levels needed to light one crystal, measured by the pilot run
+    double secondsPerState;  // Time needed to expand one state
+    string checkpointFile;
+    uint64_t checkpointKey;
+    const State* runSolution; // Best solution of finished runs
+    vector<State> resumeBeam; // Beam of the unfinished run read from the checkpoint
+    State resumeSolution;
+    int resumeSteps;
+    double lastCheckpoint;
+    int processShardsCount;
+    double adaptiveTimeShare; // Part of the remaining time adaptive width is planned for
+    SearchTrace* trace;
+    SearchProgress* progress;
+    size_t candidatesCount; // Moves offered to the beam of the current level
+    size_t dedupHits;       // Moves dropped as leading to a state already in the beam
+    double maxRegionShare;  // Multiple of even share of the beam moves in one region can fill, 0 for no limit
+    size_t maxRegionMoves;  // Moves in one region allowed in the beam of the current level
+    int regionsWidth;
+    vector<size_t> regionMoves; // Moves in the beam by region of their item
+#if defined(USE_PROCESS_SHARDS) && !defined(WIN32)
+    unique_ptr<ProcessShards> processShards;
+#endif
+
+    static const uint32_t CheckpointMagic = 0x50434C43; // "CLCP"
+
+    bool TimeExceeded()
+    {
+        return getTime() >= deadline || (progress != nullptr && progress->Cancelled());
+    }
+
+    // Identifies input board, costs and search type, so checkpoint of another problem is not resumed
+    static uint64_t GetCheckpointKey(const State& inputState, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        uint64_t key = 14695981039346656037ull;
+        auto add = [&key](int value) { key = (key ^ (uint32_t)value) * 1099511628211ull; };
+
+        add(inputState.width);
+        add(inputState.height);
+        for (mpos mp = 0; mp < inputState.width * inputState.height; mp++)
+            add((int)inputState.board[mp]);
+        add(costLantern);
+        add(costMirror);
+        add(costObstacle);
+        add(maxMirrors);
+        add(maxObstacles);
+        return key;
+    }
+
+    // States are stored as their placed items and replayed on the input state when read, which is much
+    // smaller than their snapshots. File is written under temporary name and renamed, so it is never partial.
+    void WriteCheckpoint(const vector<State>& beam, const State& bestSolution, int steps)
+    {
+        string tempFile = checkpointFile + ".tmp";
+        ofstream out(tempFile, ios::binary);
+        uint32_t magic = CheckpointMagic;
+        uint64_t beamSize = beam.size();
+        uint64_t width = maxRayWidth;
+
+        out.write((const char*)&magic, sizeof(magic));
+        out.write((const char*)&checkpointKey, sizeof(checkpointKey));
+        out.write((const char*)&adaptiveWidth, sizeof(adaptiveWidth));
+        out.write((const char*)&width, sizeof(width));
+        out.write((const char*)&levelsPerCrystal, sizeof(levelsPerCrystal));
+        out.write((const char*)&secondsPerState, sizeof(secondsPerState));
+        out.write((const char*)&steps, sizeof(steps));
+        (runSolution != nullptr ? *runSolution : bestSolution).SaveItems(out);
+        bestSolution.SaveItems(out);
+        out.write((const char*)&beamSize, sizeof(beamSize));
+        for (auto& state : beam)
+            state.SaveItems(out);
+        out.close();
+        if (!out)
+        {
+            remove(tempFile.c_str());
+            return;
+        }
+#ifdef WIN32
+        remove(checkpointFile.c_str());
+#endif
+        rename(tempFile.c_str(), checkpointFile.c_str());
+        lastCheckpoint = getTime();
+    }
+
+    bool ReadCheckpoint(const State& inputState, State& solution, int costLantern, int costMirror, int costObstacle)
+    {
+        ifstream in(checkpointFile, ios::binary);
+        uint32_t magic = 0;
+        uint64_t key = 0, width = 0, beamSize = 0;
+        bool savedAdaptiveWidth = false;
+        double savedLevelsPerCrystal = 0, savedSecondsPerState = 0;
+        int steps = 0;
+        State savedSolution = inputState;
+        State savedBest = inputState;
+        vector<State> beam;
+
+        in.read((char*)&magic, sizeof(magic));
+        in.read((char*)&key, sizeof(key));
+        if (!in || magic != CheckpointMagic || key != checkpointKey)
+            return false;
+        in.read((char*)&savedAdaptiveWidth, sizeof(savedAdaptiveWidth));
+        in.read((char*)&width, sizeof(width));
+        in.read((char*)&savedLevelsPerCrystal, sizeof(savedLevelsPerCrystal));
+        in.read((char*)&savedSecondsPerState, sizeof(savedSecondsPerState));
+        in.read((char*)&steps, sizeof(steps));
+        if (!in || !savedSolution.ReplayItems(in, costLantern, costMirror, costObstacle) || !savedBest.ReplayItems(in, costLantern, costMirror, costObstacle))
+            return false;
+        if (!in.read((char*)&beamSize, sizeof(beamSize)) || beamSize > 1000000)
+            return false;
+        beam.reserve((size_t)beamSize);
+        for (uint64_t i = 0; i < beamSize; i++)
+        {
+            beam.push_back(inputState);
+            if (!beam.back().ReplayItems(in, costLantern, costMirror, costObstacle))
+                return false;
+        }
+
+        adaptiveWidth = savedAdaptiveWidth;
+        maxRayWidth = (size_t)width;
+        levelsPerCrystal = savedLevelsPerCrystal;
+        secondsPerState = savedSecondsPerState;
+        solution = savedSolution;
+        resumeSolution = savedBest;
+        resumeSteps = steps;
+        resumeBeam.swap(beam);
+        cerr << "Resumed " << resumeBeam.size() << " states at level " << steps << ", score " << std::max(solution.score, resumeSolution.score) << endl;
+        return true;
+    }
+
+    // Sets width of the next level, so that the run ends at the deadline. Time per state is measured on
+    // previous levels, remaining depth is predicted from crystals not lit yet by the best state in the beam.
+    void ScheduleRayWidth(const vector<State>& states, double levelSeconds, size_t expandedStates)
+    {
+        if (expandedStates > 0)
+            secondsPerState = 0.5 * secondsPerState + 0.5 * levelSeconds / expandedStates;
+
+        int litCrystals = 0;
+
+        for (auto& state : states)
+            litCrystals = std::max(litCrystals, state.litCrystals);
+
+        double remainingLevels = std::max(1.0, (State::crystalsCount - litCrystals) * levelsPerCrystal);
+        double timeLeft = (deadline - getTime()) * adaptiveTimeShare;
+        double width = timeLeft / (remainingLevels * std::max(secondsPerState, 1e-7));
+
+        // After the first level, width changes gradually, so one slow or fast level does not swing it
+        if (expandedStates > 0)
+            width = std::max(maxRayWidth / 2.0, std::min(maxRayWidth * 2.0, width));
+        maxRayWidth = (size_t)std::max(1.0, std::min(1e6, width));
+    }
+
+    // Region of the item placed by move; lantern pair is grouped by its first lantern
+    int GetRegion(const Move& move) const
+    {
+        Position position = move.type == MoveType::Obstacle ? move.obstacle.position : move.type == MoveType::Mirror ? move.mirror.position : move.lantern.position;
+
+        return position.y / DIVERSE_BEAM_REGION_SIZE * regionsWidth + position.x / DIVERSE_BEAM_REGION_SIZE;
+    }
+
+    static int Rank(const Move& move)
+    {
+        return Ranking::Rank(move) + Ranking::Rank(*move.state);
+    }
+
+    static bool MoveComparison(const Move& m1, const Move& m2)
+    {
+        return Rank(m2) < Rank(m1);
+    }
+
+    unsigned TieBreakKey(const Move& move) const
+    {
+        return ((unsigned)move.hash ^ tieBreakSeed) * 2654435761u;
+    }
+
+    void AddMove(const Move& move, vector<Move>& moves)
+    {
+        candidatesCount++;
+        if (moves.size() >= maxRayWidth)
+        {
+            // Move tied with the last survivor can still win on seeded tie break
+            int lastRank = Rank(moves.back()), rank = Rank(move);
+            if (lastRank > rank || (lastRank == rank && (tieBreakSeed == 0 || TieBreakKey(move) >= TieBreakKey(moves.back()))))
+                return;
+        }
+
+        if (moves.empty())
+        {
+            moves.push_back(move);
+            if (maxRegionShare > 0)
+                regionMoves[GetRegion(move)]++;
+            return;
+        }
+
+        // Skip moves leading to the same state; with tie break seed, equally ranked moves are ordered by seeded hash
+        auto it = lower_bound(moves.begin(), moves.end(), move, MoveComparison);
+        auto insertPosition = moves.end();
+        int rank = Rank(move);
+
+        while (it != moves.end() && Rank(*it) == rank)
+        {
+            if (it->hash == move.hash && it->Same(move))
+            {
+                dedupHits++;
+                return;
+            }
+            if (tieBreakSeed != 0 && insertPosition == moves.end() && TieBreakKey(move) < TieBreakKey(*it))
+                insertPosition = it;
+            it++;
+        }
+        if (insertPosition == moves.end())
+            insertPosition = it;
+        if (maxRegionShare > 0)
+        {
+            int region = GetRegion(move);
+            size_t& count = regionMoves[region];
+
+            // Region with full share of the beam gives up its worst move if this one is better
+            if (count >= maxRegionMoves)
+            {
+                auto worst = find_if(moves.rbegin(), moves.rend(), [&](const Move& m) { return GetRegion(m) == region; }).base() - 1;
+
+                if (worst < insertPosition)
+                    return;
+
+                size_t index = insertPosition - moves.begin();
+
+                moves.erase(worst);
+                insertPosition = moves.begin() + index;
+                count--;
+            }
+            count++;
+        }
+        moves.insert(insertPosition, move);
+        if (moves.size() > maxRayWidth)
+        {
+            if (maxRegionShare > 0)
+                regionMoves[GetRegion(moves.back())]--;
+            moves.resize(maxRayWidth);
+        }
+    }
+};
+
+// Exact depth first search for small boards. Cells are decided in row order and placed lantern must not be
+// lit by lanterns in decided cells. Without mirrors light between two cells can be blocked only by cells
+// between them, so every valid placement is reached. Branches are cut by upper bound: crystal can get
+// missing colors only from undecided cells on its rays that can still be unlit, each paying its share of
+// the lantern cost (lantern is shared by at most the crystals it can see), and light of wrong color can be
+// removed only by an obstacle in undecided cell.
+class BranchAndBound
+{
+public:
+    BranchAndBound(double deadline, SearchProgress* progress = nullptr)
+        : deadline(deadline)
+        , progress(progress)
+    {
+    }
+
+    static bool Accepts(const State& state, int maxMirrors)
+    {
+        return maxMirrors == 0 && state.width * state.height <= EXACT_SOLVER_MAX_CELLS && State::crystalsCount <= EXACT_SOLVER_MAX_CRYSTALS;
+    }
+
+    // Improves solution with placements found by the search. Returns true if the solution is proven optimal.
+    bool Solve(const State& inputState, State& solution, int costLantern, int costObstacle, int maxObstacles)
+    {
+        this->costLantern = costLantern;
+        this->costObstacle = costObstacle;
+        this->maxObstacles = maxObstacles;
+        cellsCount = inputState.width * inputState.height;
+        nodes = 0;
+        aborted = false;
+        bestSolution = &solution;
+        crystals.clear();
+        for (mpos mp = 0; mp < cellsCount; mp++)
+            if ((inputState.board[mp] & BoardField::Crystal) != BoardField::Empty)
+                crystals.push_back(mp);
+        states.assign(cellsCount + 1, inputState);
+        Search(0, 0);
+        cerr << "Exact search: " << nodes << " nodes, " << solution.score << (aborted ? " not proven" : " optimal") << endl;
+        return !aborted;
+    }
+
+private:
+    double deadline;
+    SearchProgress* progress;
+    int costLantern;
+    int costObstacle;
+    int maxObstacles;
+    mpos cellsCount;
+    long long nodes;
+    bool aborted;
+    State* bestSolution;
+    vector<State> states; // States of the current path, indexed by depth
+    vector<mpos> crystals;
+
+    // Upper bound of score reachable from state when cells before mp are decided. Costs are shared by up to
+    // 4 crystals, so the bound is summed in twelfths of a point.
+    int UpperBound(const State& state, mpos mp)
+    {
+        static const int8 directions[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+        bool obstaclesOk = state.obstaclesCount < maxObstacles;
+        int bound = 12 * state.score;
+
+        for (mpos crystal : crystals)
+        {
+            Color crystalColor = (Color)(state.board[crystal] & BoardField::ColorMask);
+            Color lightColor = (Color)(state.lightMap[crystal] & Light::ColorMask);
+
+            if (lightColor == crystalColor)
+                continue;
+
+            bool wrongColor = (lightColor & ~crystalColor) != Color::Empty;
+            int lanternShare = numeric_limits<int>::max(); // Cheapest share of lantern lighting the crystal
+            bool undecidedCell = false;
+
+            for (auto& direction : directions)
+                for (int x = crystal % state.width + direction[0], y = crystal / state.width + direction[1]; x >= 0 && x < state.width && y >= 0 && y < state.height; x += direction[0], y += direction[1])
+                {
+                    mpos cell = y * state.width + x;
+
+                    if ((state.board[cell] & BoardField::ObjectMask) != BoardField::Empty)
+                        break;
+                    if (cell < mp)
+                        continue;
+                    undecidedCell = true;
+
+                    // Cell stays lit if all cells between it and lantern lighting it are decided
+                    Light light = state.lightMap[cell];
+
+                    if ((light & Light::ColorMask) == Light::Empty || (cell != mp && ((light & Light::DownMask) == Light::Empty || cell - state.width >= mp)))
+                    {
+                        int crystalsSeen = (state.crystalsFromLeft[cell] >= 0) + (state.crystalsFromRight[cell] >= 0) + (state.crystalsFromUp[cell] >= 0) + (state.crystalsFromDown[cell] >= 0);
+
+                        lanternShare = std::min(lanternShare, 12 * costLantern / crystalsSeen);
+                    }
+                }
+            // Crystal ends either with its color or unlit, any other light scores the same as now
+            bool canBlock = undecidedCell && obstaclesOk;
+            int score = State::GetCrystalScore(crystalColor, lightColor);
+            int gain = 0;
+
+            if (lightColor != Color::Empty && canBlock)
+                gain = 12 * -score - 3 * costObstacle;
+            if (!wrongColor || canBlock)
+            {
+                Color missingColor = crystalColor & ~lightColor;
+                int missingColors = ((missingColor & Color::Blue) != Color::Empty) + ((missingColor & Color::Yellow) != Color::Empty) + ((missingColor & Color::Red) != Color::Empty);
+
+                if (missingColors == 0 || lanternShare != numeric_limits<int>::max())
+                    gain = std::max(gain, 12 * (State::GetCrystalScore(crystalColor, crystalColor) - score) - missingColors * lanternShare - (wrongColor ? 3 * costObstacle : 0));
+            }
+            bound += std::max(0, gain);
+        }
+        return bound / 12;
+    }
+
+    void Search(int depth, mpos mp)
+    {
+        State& state = states[depth];
+
+        if ((++nodes & 1023) == 0 && (getTime() >= deadline || (progress != nullptr && progress->Cancelled())))
+            aborted = true;
+        if (aborted)
+            return;
+        if (state.score > bestSolution->score)
+        {
+            *bestSolution = state;
+            if (progress != nullptr)
+                progress->Report(state);
+        }
+
+        // Skip cells with objects from the input board
+        while (mp < cellsCount && (state.board[mp] & BoardField::ObjectMask) != BoardField::Empty)
+            mp++;
+        if (mp == cellsCount || UpperBound(state, mp) <= bestSolution->score)
+            return;
+
+        Position position(mp % state.width, mp / state.width);
+
+        // Lanterns go first, best scoring first, as they find good solutions early
+        BoardField useful = State::GetUsefulMoves(mp);
+        Color colors = (Color)(state.crystalsLightMap[mp] & Light::ColorMask) & (Color)(useful & BoardField::ColorMask);
+
+        if ((state.lightMap[mp] & Light::ColorMask) == Light::Empty && colors != Color::Empty)
+        {
+            int scores[3], potentialScores[3];
+            int order[3] = { 0, 1, 2 };
+            static const Color lanternColors[3] = { Color::Blue, Color::Yellow, Color::Red };
+
+            state.GetLanternScores(mp, costLantern, scores, potentialScores);
+            sort(order, order + 3, [&](int a, int b) { return scores[a] > scores[b]; });
+            for (int i : order)
+                if ((colors & lanternColors[i]) != Color::Empty)
+                {
+                    Lantern lantern;
+
+                    lantern.position = position;
+                    lantern.color = lanternColors[i];
+                    states[depth + 1] = state;
+                    states[depth + 1].PutLantern(lantern, costLantern);
+                    Search(depth + 1, mp + 1);
+                }
+        }
+
+        // Empty cell
+        Search(depth, mp + 1);
+
+        if (state.obstaclesCount < maxObstacles && (useful & BoardField::Obstacle) != BoardField::Empty)
+        {
+            Obstacle obstacle;
+
+            obstacle.position = position;
+            states[depth + 1] = state;
+            states[depth + 1].PutObstacle(obstacle, costObstacle);
+            Search(depth + 1, mp + 1);
+        }
+    }
+};
+
+#ifdef USE_SOLUTION_CACHE
+
+#include <cstdint>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Memory mapped file with fixed number of solution slots; least recently used slot is replaced when the cache is full
+class SolutionCache
+{
+public:
+    SolutionCache(const char* path)
+        : header(nullptr)
+    {
+        size_t size = sizeof(Header) + sizeof(Slot) * SOLUTION_CACHE_SLOTS;
+
+#ifndef WIN32
+        int file = open(path, O_RDWR | O_CREAT, 0644);
+        struct stat fileStat;
+
+        if (file < 0)
+            return;
+        if (fstat(file, &fileStat) != 0 || (size_t)fileStat.st_size != size)
+            if (ftruncate(file, 0) != 0 || ftruncate(file, size) != 0)
+            {
+                close(file);
+                return;
+            }
+
+        void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+        close(file);
+        if (view == MAP_FAILED)
+            return;
+#else
+        HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, (DWORD)size, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr)
+            return;
+
+        void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+        if (view == nullptr)
+        {
+            CloseHandle(mapping);
+            return;
+        }
+#endif
+        header = (Header*)view;
+        slots = (Slot*)(header + 1);
+
+        // Reset cache written with different layout
+        if (header->magic != Magic || header->version != Version || header->slotsCount != SOLUTION_CACHE_SLOTS || header->maxItems != SOLUTION_CACHE_MAX_ITEMS)
+        {
+            memset(view, 0, size);
+            header->magic = Magic;
+            header->version = Version;
+            header->slotsCount = SOLUTION_CACHE_SLOTS;
+            header->maxItems = SOLUTION_CACHE_MAX_ITEMS;
+        }
+    }
+
+    ~SolutionCache()
+    {
+        if (header == nullptr)
+            return;
+#ifndef WIN32
+        munmap(header, sizeof(Header) + sizeof(Slot) * SOLUTION_CACHE_SLOTS);
+#else
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+#endif
+    }
+
+    static uint64_t GetKey(const vector<string>& targetBoard, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        // FNV-1a over board dimensions, board fields and costs
+        uint64_t key = 14695981039346656037ULL;
+        auto add = [&key](int value)
+        {
+            key = (key ^ (uint32_t)value) * 1099511628211ULL;
+        };
+
+        add((int)targetBoard.size());
+        add((int)targetBoard[0].size());
+        for (auto& row : targetBoard)
+            for (char field : row)
+                add((field >= '1' && field <= '6') || field == 'X' ? field : '.');
+        add(costLantern);
+        add(costMirror);
+        add(costObstacle);
+        add(maxMirrors);
+        add(maxObstacles);
+        return key != 0 ? key : 1;
+    }
+
+    bool Find(uint64_t key, vector<string>& result, int& score)
+    {
+        if (header == nullptr)
+            return false;
+
+        for (int i = 0; i < SOLUTION_CACHE_SLOTS; i++)
+            if (slots[i].key == key)
+            {
+                Slot& slot = slots[i];
+
+                slot.lastUse = ++header->clock;
+                score = slot.score;
+                result.clear();
+                for (int j = 0; j < slot.itemsCount; j++)
+                {
+                    stringstream ss;
+                    Item& item = slot.items[j];
+
+                    ss << (int)item.y << " " << (int)item.x << " " << item.symbol;
+                    result.push_back(ss.str());
+                }
+                return true;
+            }
+        return false;
+    }
+
+    void Store(uint64_t key, const vector<string>& result, int score)
+    {
+        if (header == nullptr || result.size() > SOLUTION_CACHE_MAX_ITEMS)
+            return;
+
+        // Replace the same key, an empty slot or the least recently used one
+        Slot* slot = &slots[0];
+
+        for (int i = 0; i < SOLUTION_CACHE_SLOTS; i++)
+        {
+            if (slots[i].key == key || slots[i].key == 0)
+            {
+                slot = &slots[i];
+                break;
+            }
+            if (slots[i].lastUse < slot->lastUse)
+                slot = &slots[i];
+        }
+
+        // Key is written last, so a slot that is being written is never found
+        slot->key = 0;
+        slot->score = score;
+        slot->itemsCount = (int)result.size();
+        for (size_t i = 0; i < result.size(); i++)
+        {
+            stringstream ss(result[i]);
+            int y, x;
+
+            ss >> y >> x >> slot->items[i].symbol;
+            slot->items[i].y = (int16)y;
+            slot->items[i].x = (int16)x;
+        }
+        slot->lastUse = ++header->clock;
+        slot->key = key;
+    }
+
+private:
+    static const uint32_t Magic = 0x4C435243; // "CRCL"
+    static const uint32_t Version = 3;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slotsCount;
+        uint32_t maxItems;
+        uint64_t clock;
+    };
+
+    struct Item
+    {
+        int16 y;
+        int16 x;
+        char symbol; // 'X', '/', '\\' or lantern color
+    };
+
+    struct Slot
+    {
+        uint64_t key;
+        uint64_t lastUse;
+        int score;
+        int itemsCount;
+        Item items[SOLUTION_CACHE_MAX_ITEMS];
+    };
+
+    Header* header;
+    Slot* slots;
+#ifdef WIN32
+    HANDLE mapping;
+#endif
+};
+
+#endif
+
+// Board properties solver profile is chosen by. Extracted from the input state in one pass over the cells.
+struct BoardFeatures
+{
+    int side;                 // Longer side of the board
+    double crystalDensity;    // Crystals per cell
+    double secondaryShare;    // Part of crystals with secondary color
+    double obstacleDensity;   // Input obstacles per cell
+    int costLantern;
+    double obstacleCostRatio; // Obstacle cost per lantern cost
+    double obstaclesShare;    // Obstacles that can be placed per crystal
+
+    static BoardFeatures Extract(const State& inputState, int costLantern, int costObstacle, int maxObstacles)
+    {
+        BoardFeatures features;
+        mpos cells = inputState.width * inputState.height;
+        int crystals = 0, secondaryCrystals = 0, obstacles = 0;
+
+        for (mpos mp = 0; mp < cells; mp++)
+        {
+            BoardField field = inputState.board[mp];
+
+            if ((field & BoardField::Crystal) != BoardField::Empty)
+            {
+                int color = (int)(field & BoardField::ColorMask);
+
+                crystals++;
+                secondaryCrystals += color != 1 && color != 2 && color != 4;
+            }
+            else if ((field & BoardField::ObjectMask) == BoardField::Obstacle)
+                obstacles++;
+        }
+        features.side = std::max(inputState.width, inputState.height);
+        features.crystalDensity = (double)crystals / cells;
+        features.secondaryShare = (double)secondaryCrystals / std::max(1, crystals);
+        features.obstacleDensity = (double)obstacles / cells;
+        features.costLantern = costLantern;
+        features.obstacleCostRatio = (double)costObstacle / costLantern;
+        features.obstaclesShare = (double)maxObstacles / std::max(1, crystals);
+        return features;
+    }
+
+    // Boards are classified by size and lantern cost, which change the best settings the most
+    int GetClass() const
+    {
+        int sizeClass = side <= 40 ? 0 : side <= 70 ? 1 : 2;
+
+        return sizeClass * 2 + (costLantern > 5);
+    }
+};
+
+// Settings of one solver run which can differ by board class
+struct SolverProfile
+{
+    const char* name;
+    bool potentialScore;      // Rank states by potential score instead of score
+    double adaptiveTimeShare; // Part of the remaining time adaptive width is planned for
+    double timeShare;         // Part of the time limit used
+
+    // Compile time settings
+    static const SolverProfile& GetDefault()
+    {
+#ifdef USE_POTENTIAL_SCORE
+        static const SolverProfile profile = { "default", true, ADAPTIVE_BEAM_TIME_SHARE, 1.0 };
+#else
+        static const SolverProfile profile = { "default", false, ADAPTIVE_BEAM_TIME_SHARE, 1.0 };
+#endif
+
+        return profile;
+    }
+
+    // Generated by -profiles sweep of the test corpus: per board class, the best total score, and of profiles
+    // within SOLVER_PROFILES_TOLERANCE of it, the one using the least time
+    static const SolverProfile& Get(const BoardFeatures& features)
+    {
+        static const SolverProfile profiles[] =
+        {
+            { "small-cheap", true, 0.9, 0.5 },
+            { "small-expensive", true, 0.6, 1.0 },
+            { "medium-cheap", true, 0.6, 1.0 },
+            { "medium-expensive", true, 0.6, 1.0 },
+            { "large-cheap", true, 0.6, 1.0 },
+            { "large-expensive", true, 0.6, 1.0 },
+        };
+
+        return profiles[features.GetClass()];
+    }
+};
+
+class CrystalLighting
+{
+private:
+    double stopwatchStart;
+    double timeLimit;
+    double elapsedSeconds;
+    int solutionScore;
+    const SolverProfile* profile;       // Profile of the current board
+    const SolverProfile* forcedProfile; // Profile used for every board instead of the classified one
+#ifdef USE_SEARCH_TRACE
+    unique_ptr<SearchTrace> trace;      // Trace of the current board
+#endif
+    SearchProgress progress;            // Best solution and cancellation of the current placeItems call
+
+public:
+    CrystalLighting(double timeLimit = MAX_EXECUTION_TIME)
+        : timeLimit(timeLimit)
+        , elapsedSeconds(0)
+        , solutionScore(0)
+        , profile(&SolverProfile::GetDefault())
+        , forcedProfile(nullptr)
+    {
+    }
+
+    // Uses given profile for all boards, nullptr restores choosing it by board features
+    void SetProfile(const SolverProfile* profile)
+    {
+        forcedProfile = profile;
+    }
+
+    // Profile used by the last placeItems call
+    const SolverProfile& GetProfile() const
+    {
+        return *profile;
+    }
+
+    // Search of placeItems running on another thread can be watched and cancelled through its progress
+    SearchProgress& GetProgress()
+    {
+        return progress;
+    }
+
+    const SearchProgress& GetProgress() const
+    {
+        return progress;
+    }
+
+    // Time budget for next placeItems call; the same object can be reused for many boards
+    void SetTimeLimit(double seconds)
+    {
+        timeLimit = seconds > 0 ? seconds : MAX_EXECUTION_TIME;
+    }
+
+    // Score of the solution returned by the last placeItems call
+    int GetSolutionScore() const
+    {
+        return solutionScore;
+    }
+
+    // Time spent in the last placeItems call
+    double GetElapsedSeconds() const
+    {
+        return elapsedSeconds;
+    }
+
+    vector<string> placeItems(vector<string> targetBoard, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        // Start stopwatch
+        stopwatchStart = getTime();
+        progress.ClearBest();
+
+#ifdef USE_SOLUTION_CACHE
+        // Return solution for the same board and costs if we already solved it
+        SolutionCache cache(SOLUTION_CACHE_FILE);
+        uint64_t cacheKey = SolutionCache::GetKey(targetBoard, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+        vector<string> cachedResult;
+
+        if (cache.Find(cacheKey, cachedResult, solutionScore))
+        {
+            progress.Report(solutionScore, cachedResult);
+            elapsedSeconds = getTime() - stopwatchStart;
+            return cachedResult;
+        }
+#endif
+
+        // States of the previous call are gone, so their placed items and buffers can be freed
+        ItemArena::Reset();
+        State::ReleaseMemoryBuffers();
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::Reset();
+#endif
+
+        // Parse input data
+        State inputState = ParseBoard(targetBoard);
+
+        maxMirrors = 0; // TODO:
+#ifdef USE_USEFUL_MOVES
+        State::MarkUsefulMoves(inputState, costLantern, costObstacle, maxMirrors);
+#endif
+        // Choose settings for this board
+#ifdef USE_SOLVER_PROFILES
+        profile = forcedProfile != nullptr ? forcedProfile : &SolverProfile::Get(BoardFeatures::Extract(inputState, costLantern, costObstacle, maxObstacles));
+#else
+        profile = forcedProfile != nullptr ? forcedProfile : &SolverProfile::GetDefault();
+#endif
+#ifdef USE_SEARCH_TRACE
+        trace.reset(new SearchTrace(SEARCH_TRACE_FILE, stopwatchStart, inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles));
+#endif
+
+        // Do place items on the board
+        double deadline = stopwatchStart + timeLimit * profile->timeShare;
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::SetPhase(AllocationPhase::BeamSearch);
+#endif
+#ifdef USE_EXACT_SOLVER
+        State solution = BranchAndBound::Accepts(inputState, maxMirrors)
+            ? RunExactSearch(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles)
+            : RunBeamSearch(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+#else
+        State solution = RunBeamSearch(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+#endif
+
+        // Return result
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::SetPhase(AllocationPhase::Output);
+#endif
+        vector<string> result = solution.GetResult();
+
+        solutionScore = solution.score;
+        progress.Report(solution);
+#ifdef USE_SOLUTION_CACHE
+        cache.Store(cacheKey, result, solutionScore);
+#endif
+#ifdef USE_SEARCH_TRACE
+        trace.reset();
+#endif
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::Report(cerr);
+#endif
+        elapsedSeconds = getTime() - stopwatchStart;
+        return result;
+    }
+
+    // Beam search result found in a short time is the first bound of exact search. If exact search doesn't
+    // finish in its time, beam search gets the rest.
+    State RunExactSearch(const State& inputState, double deadline, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        double profileTimeLimit = timeLimit * profile->timeShare;
+        double exactDeadline = stopwatchStart + profileTimeLimit * EXACT_SOLVER_TIME_SHARE;
+        State solution = RunBeamSearch(inputState, stopwatchStart + profileTimeLimit * EXACT_SOLVER_BEAM_SHARE, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::SetPhase(AllocationPhase::ExactSearch);
+#endif
+        bool proven = BranchAndBound(exactDeadline, &progress).Solve(inputState, solution, costLantern, costObstacle, maxObstacles);
+#ifdef USE_ALLOCATION_TRACKING
+        AllocationTracker::SetPhase(AllocationPhase::BeamSearch);
+#endif
+        if (!proven)
+        {
+            State s = RunBeamSearch(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+
+            if (s.score > solution.score)
+                solution = s;
+        }
+        return solution;
+    }
+
+    State RunBeamSearch(const State& inputState, double deadline, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+#ifdef USE_PORTFOLIO
+        return RunPortfolio(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+#else
+        return profile->potentialScore
+            ? RunRankedBeamSearch<PotentialScoreRanking>(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles)
+            : RunRankedBeamSearch<ScoreRanking>(inputState, deadline, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+#endif
+    }
+
+    template<class Ranking>
+    State RunRankedBeamSearch(const State& inputState, double deadline, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        BeamSearch<Ranking, DefaultMoveGenerator> beamSearch(deadline);
+
+        beamSearch.SetAdaptiveTimeShare(profile->adaptiveTimeShare);
+        beamSearch.SetProgress(&progress);
+#ifdef USE_CHECKPOINT
+        beamSearch.SetCheckpointFile(CHECKPOINT_FILE);
+#endif
+#ifdef USE_SEARCH_TRACE
+        beamSearch.SetTrace(trace.get());
+#endif
+#ifdef USE_PROCESS_SHARDS
+        beamSearch.SetProcessShards(PROCESS_SHARDS_COUNT > 0 ? PROCESS_SHARDS_COUNT : std::max(1u, thread::hardware_concurrency()));
+#endif
+        return beamSearch.Run(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+    }
+
+    static State ParseBoard(const vector<string>& targetBoard)
+    {
+        int height = (int)targetBoard.size();
+        int width = (int)targetBoard[0].size();
+        State inputState(width, height);
+
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                BoardField field;
+
+                switch (targetBoard[y][x])
+                {
+                case '.':
+                default:
+                    field = BoardField::Empty;
+                    break;
+                case 'X':
+                    field = BoardField::Obstacle;
+                    break;
+                case '1':
+                case '2':
+                case '3':
+                case '4':
+                case '5':
+                case '6':
+                    field = BoardField::Crystal | (BoardField)(targetBoard[y][x] - '0');
+                    break;
+                }
+                inputState.Board(y, x) = field;
+            }
+        inputState.UpdateFromBoard();
+        return inputState;
+    }
+
+private:
+    template<class Ranking, class MoveGenerator>
+    static void RunPolicy(unique_ptr<State>& solution, const State& inputState, double deadline, unsigned tieBreakSeed, SearchProgress* progress, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        BeamSearch<Ranking, MoveGenerator> beamSearch(deadline, tieBreakSeed);
+
+        beamSearch.SetProgress(progress);
+        solution.reset(new State(beamSearch.Run(inputState, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles)));
+    }
+
+    State RunPortfolio(const State& inputState, double deadline, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles)
+    {
+        typedef void (*PolicyFunction)(unique_ptr<State>&, const State&, double, unsigned, SearchProgress*, int, int, int, int, int);
+        struct PortfolioEntry
+        {
+            PolicyFunction run;
+            unsigned tieBreakSeed;
+        };
+        static const PortfolioEntry portfolio[] =
+        {
+            { &RunPolicy<DefaultRanking, DefaultMoveGenerator>, 0 },
+            { &RunPolicy<ScoreRanking, PrecalculatedMoveGenerator>, 0 },
+            { &RunPolicy<PotentialScoreRanking, PrecalculatedMoveGenerator>, 1 },
+            { &RunPolicy<ScoreRanking, PrecalculatedMoveGenerator>, 1 },
+            { &RunPolicy<PotentialScoreRanking, PrecalculatedMoveGenerator>, 2 },
+            { &RunPolicy<ScoreRanking, PrecalculatedMoveGenerator>, 2 },
+            { &RunPolicy<PotentialScoreRanking, FullScanMoveGenerator>, 0 },
+            { &RunPolicy<ScoreRanking, FullScanMoveGenerator>, 0 },
+        };
+        size_t portfolioSize = sizeof(portfolio) / sizeof(portfolio[0]);
+        size_t threadsCount = std::max(1u, std::min((unsigned)portfolioSize, thread::hardware_concurrency()));
+        vector<unique_ptr<State>> solutions(threadsCount);
+        vector<thread> threads;
+
+        for (size_t i = 1; i < threadsCount; i++)
+            threads.emplace_back(portfolio[i].run, ref(solutions[i]), cref(inputState), deadline, portfolio[i].tieBreakSeed, &progress, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+        portfolio[0].run(solutions[0], inputState, deadline, portfolio[0].tieBreakSeed, &progress, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+        for (auto& t : threads)
+            t.join();
+
+        // Pick the best solution among all policies
+        size_t best = 0;
+
+        for (size_t i = 1; i < threadsCount; i++)
+            if (solutions[i]->score > solutions[best]->score)
+                best = i;
+        return std::move(*solutions[best]);
+    }
+};
+
+// Runs placeItems on its own thread with given time budget. Best solution found so far can be read and the
+// search cancelled from any thread while it runs; cancelled search returns its best solution.
+// Solver keeps board data and placed items in process-wide statics, so only one search can run at a time:
+// Start fails while search of another handle runs, and placeItems must not be called meanwhile either.
+class AnytimeSolver
+{
+public:
+    AnytimeSolver()
+        : done(true)
+    {
+    }
+
+    ~AnytimeSolver()
+    {
+        Cancel();
+        Wait();
+    }
+
+    // Budget of 0 seconds is the default time limit. Returns false if search of another handle is running.
+    bool Start(const vector<string>& targetBoard, int costLantern, int costMirror, int costObstacle, int maxMirrors, int maxObstacles, double seconds)
+    {
+        bool running = false;
+
+        Cancel();
+        Wait();
+        if (!Running().compare_exchange_strong(running, true))
+            return false;
+        solver.GetProgress().Reset();
+        solver.SetTimeLimit(seconds);
+        done.store(false, memory_order_relaxed);
+        worker = thread([=]()
+        {
+            result = solver.placeItems(targetBoard, costLantern, costMirror, costObstacle, maxMirrors, maxObstacles);
+            Running().store(false);
+            done.store(true, memory_order_release);
+        });
+        return true;
+    }
+
+    void SetImprovementCallback(SearchProgress::ImprovementCallback callback)
+    {
+        solver.GetProgress().SetImprovementCallback(callback);
+    }
+
+    // Returns false if no solution was found yet; search goes on
+    bool GetBestSoFar(vector<string>& items, int& score) const
+    {
+        return solver.GetProgress().GetBest(items, score);
+    }
+
+    int GetBestScore() const
+    {
+        return solver.GetProgress().GetBestScore();
+    }
+
+    void Cancel()
+    {
+        solver.GetProgress().Cancel();
+    }
+
+    bool Done() const
+    {
+        return done.load(memory_order_acquire);
+    }
+
+    // Waits for the search to end and returns its solution
+    vector<string> Wait()
+    {
+        if (worker.joinable())
+            worker.join();
+        return result;
+    }
+
+private:
+    CrystalLighting solver;
+    thread worker;
+    vector<string> result;
+    atomic<bool> done;
+
+    // Set while a search of any handle runs
+    static atomic<bool>& Running()
+    {
+        static atomic<bool> running(false);
+
+        return running;
+    }
+};
@@ -113,27 +113,13 @@ private:
 
         previousAdvices.push_back(advice);
         previousRecent.push_back(recent);
+        UpdateTrust();
         if (!previousBettings.empty() && executeTrust)
         {
             for (size_t i = 0; i < advice.size(); i++)
             {
-                int t = 0;
-                double e = 0;
-
-                for (size_t j = 0; j < previousBettings.size(); j++)
-                {
-                    double expected = previousAdvices[j][i] / 100.0;
-                    double actual = previousRecent[j + 1][i] / (double)previousBettings[j][i];
-
-                    if (std::abs(expected - actual) < TRUST_BORDER)
-                    {
-                        t++;
-                        e += expected - actual;
-                    }
-                }
-
-                trust[i] = t / (double)previousBettings.size();
-                error[i] = t > 0 ? e * 100 / t : 0;
+                trust[i] = trustHits[i] / (double)previousBettings.size();
+                error[i] = trustHits[i] > 0 ? trustErrors[i] * 100 / trustHits[i] : 0;
             }
         }
 
@@ -179,23 +165,11 @@ private:
 
         previousAdvices.push_back(advice);
         previousRecent.push_back(recent);
+        UpdateTrust();
         if (!previousBettings.empty())
         {
             for (size_t i = 0; i < advice.size(); i++)
-            {
-                int t = 0;
-
-                for (size_t j = 0; j < previousBettings.size(); j++)
-                {
-                    double expected = previousAdvices[j][i] / 100.0;
-                    double actual = previousRecent[j + 1][i] / (double)previousBettings[j][i];
-
-                    if (std::abs(expected - actual) < TRUST_BORDER)
-                        t++;
-                }
-
-                trust[i] = t / (double)previousBettings.size();
-            }
+                trust[i] = trustHits[i] / (double)previousBettings.size();
         }
 
         // Calculate amounts
@@ -260,8 +234,35 @@ private:
         return ret;
     }
 
+    // Adds the last round to expert statistics: income reported in recent is compared with the advice and
+    // the betting of the previous round. Rounds are added in order, so sums are the same as summing all rounds.
+    void UpdateTrust()
+    {
+        if (previousBettings.empty())
+            return;
+
+        size_t j = previousBettings.size() - 1;
+        const vector<int>& advice = previousAdvices[j];
+
+        trustHits.resize(advice.size(), 0);
+        trustErrors.resize(advice.size(), 0.0);
+        for (size_t i = 0; i < advice.size(); i++)
+        {
+            double expected = advice[i] / 100.0;
+            double actual = previousRecent[j + 1][i] / (double)previousBettings[j][i];
+
+            if (std::abs(expected - actual) < TRUST_BORDER)
+            {
+                trustHits[i]++;
+                trustErrors[i] += expected - actual;
+            }
+        }
+    }
+
 private:
     vector<vector<int>> previousAdvices;
     vector<vector<int>> previousRecent;
     vector<vector<int>> previousBettings;
+    vector<int> trustHits;      // Rounds where expert's income was within TRUST_BORDER of the advice
+    vector<double> trustErrors; // Sum of advice minus income in these rounds
 };